@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "tvlink.h"
+
+/* Command line client for the TV controller's binary control protocol */
+
+#define DEFAULT_DEVICE "/dev/ttyUSB0"
+#define DEFAULT_BAUD   115200
+
+// in the order of the COUNTER_* enum in journal.h
+static const char *counter_names[] = {
+    "RC5 frames", "RC5 errors", "NEC frames", "amp on", "amp off", "journal dropped"
+};
+#define NUM_COUNTER_NAMES ((int)(sizeof(counter_names) / sizeof(counter_names[0])))
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "usage: %s [-d device] [-b baud] [-B baud] [-v] command\n"
+        "commands:\n"
+        "  ping\n"
+        "  status\n"
+        "  stats\n"
+        "  amp on|off|delay\n"
+        "  volume up|down|mute|<level>\n"
+        "  scene <number>|stop\n"
+        "  scene load <file>   write a compiled scene table to the device EEPROM\n"
+        "  monitor             print IR, power and stats events as they arrive\n"
+        "  baud                show the link speed and error counts\n"
+        "  baud <rate>         switch the link speed (use -b <rate> afterwards)\n"
+        "options:\n"
+        "  -d device           serial port (default " DEFAULT_DEVICE ")\n"
+        "  -b baud             link speed (default %d)\n"
+        "  -B baud             switch to this speed before running the command\n"
+        "  -v                  copy console text to stderr\n",
+        argv0, DEFAULT_BAUD);
+    exit(1);
+}
+
+/* a whole decimal number between min and max, or -1 */
+static long parse_number(const char *s, long min, long max)
+{
+    char *end;
+    long value;
+
+    errno = 0;
+    value = strtol(s, &end, 10);
+    if(errno || end == s || *end || value < min || value > max)
+        return -1;
+    return value;
+}
+
+static void print_counters(const uint8_t *data, int length)
+{
+    for(int i=0; i<length/2; i++)
+        printf("%-16s %u\n", (i < NUM_COUNTER_NAMES) ? counter_names[i] : "?",
+                data[2*i] | (data[2*i+1] << 8));
+}
+
+static int monitor(struct tvlink *link)
+{
+    struct tvlink_frame event;
+    int r;
+
+    r = tvlink_subscribe(link, HP_SUB_IR | HP_SUB_POWER | HP_SUB_STATS);
+    if(r < 0)
+        return r;
+
+    while(1){
+        r = tvlink_read_event(link, &event, -1);
+        if(r < 0)
+            return r;
+        switch(event.type){
+            case HP_EVENT_IR:
+                printf("ir addr %d cmd %d toggle %d\n", event.payload[0], event.payload[1], event.payload[2]);
+                break;
+            case HP_EVENT_POWER:
+                printf("power amp %s dac %s\n", event.payload[0] ? "on" : "off", event.payload[1] ? "on" : "off");
+                break;
+            case HP_EVENT_STATS:
+                printf("stats\n");
+                print_counters(event.payload, event.length);
+                break;
+            default:
+                printf("event 0x%02x, %d bytes\n", event.type, event.length);
+                break;
+        }
+        fflush(stdout);
+    }
+}
+
+static int scene_load(struct tvlink *link, const char *filename)
+{
+    uint8_t data[256];
+    FILE *f;
+    int length;
+
+    f = fopen(filename, "rb");
+    if(!f)
+        return -errno;
+    length = fread(data, 1, sizeof(data), f);
+    fclose(f);
+
+    return tvlink_scene_write(link, 0, data, length);
+}
+
+static int run(struct tvlink *link, int argc, char **argv)
+{
+    struct tvlink_status status;
+    struct tvlink_serial serial;
+    uint16_t counters[HP_MAX_PAYLOAD / 2];
+    const char *cmd = argv[0];
+    const char *arg = (argc > 1) ? argv[1] : NULL;
+    long n;
+    int r;
+
+    if(!strcmp(cmd, "ping"))
+        return tvlink_ping(link);
+
+    if(!strcmp(cmd, "status")){
+        r = tvlink_get_status(link, &status);
+        if(r < 0)
+            return r;
+        printf("amp %s\n", status.amp_on ? "on" : "off");
+        printf("dac %s\n", status.dac_on ? "on" : "off");
+        if(status.volume_known)
+            printf("volume %d\n", status.volume);
+        else
+            printf("volume unknown\n");
+        printf("predictive power on %s\n", status.predict_enabled ? "enabled" : "disabled");
+        printf("uptime %u.%03u s\n", status.uptime_ms / 1000, status.uptime_ms % 1000);
+        return 0;
+    }
+
+    if(!strcmp(cmd, "stats")){
+        r = tvlink_get_stats(link, counters, sizeof(counters) / sizeof(counters[0]));
+        if(r < 0)
+            return r;
+        for(int i=0; i<r; i++)
+            printf("%-16s %u\n", (i < NUM_COUNTER_NAMES) ? counter_names[i] : "?", counters[i]);
+        return 0;
+    }
+
+    if(!strcmp(cmd, "amp") && arg){
+        if(!strcmp(arg, "on"))
+            return tvlink_amp(link, HP_AMP_ON);
+        if(!strcmp(arg, "off"))
+            return tvlink_amp(link, HP_AMP_OFF);
+        if(!strcmp(arg, "delay"))
+            return tvlink_amp(link, HP_AMP_OFF_DELAYED);
+    }
+
+    if(!strcmp(cmd, "volume") && arg){
+        if(!strcmp(arg, "up"))
+            return tvlink_volume(link, HP_VOLUME_UP, 0);
+        if(!strcmp(arg, "down"))
+            return tvlink_volume(link, HP_VOLUME_DOWN, 0);
+        if(!strcmp(arg, "mute"))
+            return tvlink_volume(link, HP_VOLUME_MUTE, 0);
+        n = parse_number(arg, 0, 255);
+        if(n >= 0)
+            return tvlink_volume(link, HP_VOLUME_SET, n);
+    }
+
+    if(!strcmp(cmd, "scene") && arg){
+        if(!strcmp(arg, "stop"))
+            return tvlink_scene(link, HP_SCENE_STOP);
+        if(!strcmp(arg, "load") && argc > 2)
+            return scene_load(link, argv[2]);
+        n = parse_number(arg, 0, HP_SCENE_STOP - 1);
+        if(n >= 0)
+            return tvlink_scene(link, n);
+    }
+
+    if(!strcmp(cmd, "baud")){
+        if(arg){
+            n = parse_number(arg, 1, 4000000);
+            if(n < 0)
+                usage("tvctl");
+            return tvlink_set_baud(link, n);
+        }
+        r = tvlink_get_serial(link, &serial);
+        if(r < 0)
+            return r;
+        printf("baud %u\n", serial.baud);
+        printf("framing errors %u\n", serial.framing_errors);
+        printf("overrun errors %u\n", serial.overrun_errors);
+        printf("parity errors %u\n", serial.parity_errors);
+        printf("buffer full %u\n", serial.buffer_overflows);
+        return 0;
+    }
+
+    if(!strcmp(cmd, "monitor"))
+        return monitor(link);
+
+    usage("tvctl");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct tvlink link;
+    const char *device = DEFAULT_DEVICE;
+    int baud = DEFAULT_BAUD;
+    int new_baud = 0;
+    bool verbose = false;
+    int opt, r;
+
+    while((opt = getopt(argc, argv, "d:b:B:v")) != -1){
+        switch(opt){
+            case 'd': device = optarg; break;
+            case 'b': baud = parse_number(optarg, 1, 4000000); break;
+            case 'B': new_baud = parse_number(optarg, 1, 4000000); break;
+            case 'v': verbose = true; break;
+            default:  usage(argv[0]);
+        }
+    }
+    if(optind >= argc || baud < 0 || new_baud < 0)
+        usage(argv[0]);
+
+    r = tvlink_open(&link, device, baud);
+    if(r < 0){
+        fprintf(stderr, "%s: %s\n", device, strerror(-r));
+        return 1;
+    }
+    link.verbose = verbose;
+
+    if(new_baud && new_baud != baud){
+        r = tvlink_set_baud(&link, new_baud);
+        if(r < 0){
+            fprintf(stderr, "%s: switching to %d baud: %s\n", device, new_baud, strerror(-r));
+            tvlink_close(&link);
+            return 1;
+        }
+    }
+
+    r = run(&link, argc - optind, argv + optind);
+    tvlink_close(&link);
+    if(r < 0){
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(-r));
+        return 1;
+    }
+
+    return 0;
+}
+
+/* vim:set shiftwidth=4 expandtab: */
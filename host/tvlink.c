@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+#include <time.h>
+#include "tvlink.h"
+
+/* same algorithm as avr-libc's _crc_ccitt_update() */
+uint16_t tvlink_crc_update(uint16_t crc, uint8_t data)
+{
+    data ^= crc & 0xFF;
+    data ^= data << 4;
+    return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
+}
+
+static speed_t tvlink_speed(int baud)
+{
+    switch(baud){
+        case 9600:    return B9600;
+        case 19200:   return B19200;
+        case 38400:   return B38400;
+        case 57600:   return B57600;
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+        case 500000:  return B500000;
+        case 1000000: return B1000000;
+        case 2000000: return B2000000;
+    }
+    return 0;
+}
+
+static int tvlink_set_speed(struct tvlink *link, int baud)
+{
+    struct termios tio;
+    speed_t speed = tvlink_speed(baud);
+
+    if(!speed)
+        return -EINVAL;
+    if(tcgetattr(link->fd, &tio) < 0)
+        return -errno;
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSTOPB | CRTSCTS | HUPCL); // leave DTR up on close, see tvlink.h
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    if(tcsetattr(link->fd, TCSANOW, &tio) < 0)
+        return -errno;
+    tcflush(link->fd, TCIOFLUSH);
+    link->baud = baud;
+
+    return 0;
+}
+
+static long tvlink_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000L) + (ts.tv_nsec / 1000000L);
+}
+
+/* Wait for the device to come out of its bootloader: its start up banner
+   arrives, then the line goes quiet. */
+static void tvlink_wait_boot(struct tvlink *link)
+{
+    long deadline = tvlink_now_ms() + TVLINK_BOOT_MS;
+    struct pollfd pfd = { .fd = link->fd, .events = POLLIN };
+    bool started = false;
+    uint8_t discard[64];
+    int wait, r;
+
+    while((wait = deadline - tvlink_now_ms()) > 0){
+        if(started && wait > TVLINK_QUIET_MS)
+            wait = TVLINK_QUIET_MS;
+        r = poll(&pfd, 1, wait);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0){
+            if(started)
+                return;
+            continue;
+        }
+        if(read(link->fd, discard, sizeof(discard)) > 0)
+            started = true;
+    }
+}
+
+int tvlink_open(struct tvlink *link, const char *device, int baud)
+{
+    struct termios tio;
+    bool reset;
+    int r;
+
+    memset(link, 0, sizeof(*link));
+    if(!tvlink_speed(baud))
+        return -EINVAL;
+
+    link->fd = open(device, O_RDWR | O_NOCTTY);
+    if(link->fd < 0)
+        return -errno;
+
+    // if HUPCL was set, DTR dropped at the last close and has just come back up
+    if(tcgetattr(link->fd, &tio) < 0){
+        r = -errno;
+        goto fail;
+    }
+    reset = (tio.c_cflag & HUPCL);
+
+    r = tvlink_set_speed(link, baud);
+    if(r < 0)
+        goto fail;
+    if(reset)
+        tvlink_wait_boot(link);
+
+    return 0;
+
+fail:
+    close(link->fd);
+    link->fd = -1;
+    return r;
+}
+
+void tvlink_close(struct tvlink *link)
+{
+    if(link->fd >= 0)
+        close(link->fd);
+    link->fd = -1;
+}
+
+static int tvlink_send(struct tvlink *link, uint8_t seq, uint8_t type, const void *payload, uint8_t length)
+{
+    uint8_t frame[HP_OVERHEAD + HP_MAX_PAYLOAD];
+    uint16_t crc = 0xFFFF;
+    int size = 0, done, r;
+
+    if(length > HP_MAX_PAYLOAD)
+        return -EINVAL;
+
+    frame[size++] = HP_SYNC1;
+    frame[size++] = HP_SYNC2;
+    frame[size++] = length;
+    frame[size++] = seq;
+    frame[size++] = type;
+    memcpy(&frame[size], payload, length);
+    size += length;
+    for(int i=2; i<size; i++)
+        crc = tvlink_crc_update(crc, frame[i]);
+    frame[size++] = crc & 0xFF;
+    frame[size++] = crc >> 8;
+
+    for(done=0; done<size; done+=r){
+        r = write(link->fd, frame + done, size - done);
+        if(r < 0){
+            if(errno == EINTR)
+                r = 0;
+            else
+                return -errno;
+        }
+    }
+
+    return 0;
+}
+
+/* Pull the first complete frame out of the receive buffer. Returns 1 if a
+   frame was found, 0 if more data is needed. Anything which isn't part of a
+   good frame is console text, and is dropped (or echoed in verbose mode). */
+static int tvlink_parse(struct tvlink *link, struct tvlink_frame *frame)
+{
+    int skip, length;
+    uint16_t crc;
+
+    while(link->buffered > 0){
+        skip = 0;
+        if(link->buffer[0] != HP_SYNC1)
+            skip = 1;
+        else if(link->buffered >= 2 && link->buffer[1] != HP_SYNC2)
+            skip = 1;
+        else if(link->buffered >= 3 && link->buffer[2] > HP_MAX_PAYLOAD)
+            skip = 1;
+        else if(link->buffered < 3)
+            return 0;
+        else{
+            length = link->buffer[2];
+            if(link->buffered < HP_OVERHEAD + length)
+                return 0;
+            crc = 0xFFFF;
+            for(int i=2; i<5+length; i++)
+                crc = tvlink_crc_update(crc, link->buffer[i]);
+            if(link->buffer[5+length] != (crc & 0xFF) || link->buffer[6+length] != (crc >> 8))
+                skip = 1;
+            else{
+                frame->length = length;
+                frame->seq = link->buffer[3];
+                frame->type = link->buffer[4];
+                memcpy(frame->payload, &link->buffer[5], length);
+                skip = HP_OVERHEAD + length;
+            }
+        }
+
+        if(skip == 1 && link->verbose)
+            fputc(link->buffer[0], stderr);
+        link->buffered -= skip;
+        memmove(link->buffer, link->buffer + skip, link->buffered);
+        if(skip > 1)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* read the next frame of any kind */
+static int tvlink_read_frame(struct tvlink *link, struct tvlink_frame *frame, int timeout_ms)
+{
+    long deadline = tvlink_now_ms() + timeout_ms;
+    struct pollfd pfd = { .fd = link->fd, .events = POLLIN };
+    int r, wait;
+
+    while(1){
+        if(tvlink_parse(link, frame))
+            return 0;
+
+        wait = -1;
+        if(timeout_ms >= 0){
+            wait = deadline - tvlink_now_ms();
+            if(wait < 0)
+                return -ETIMEDOUT;
+        }
+        r = poll(&pfd, 1, wait);
+        if(r < 0){
+            if(errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if(r == 0)
+            return -ETIMEDOUT;
+
+        r = read(link->fd, link->buffer + link->buffered, sizeof(link->buffer) - link->buffered);
+        if(r < 0){
+            if(errno == EINTR || errno == EAGAIN)
+                continue;
+            return -errno;
+        }
+        if(r == 0)
+            return -EIO;
+        link->buffered += r;
+    }
+}
+
+static void tvlink_queue_event(struct tvlink *link, const struct tvlink_frame *event)
+{
+    if(link->event_count == TVLINK_EVENT_QUEUE){ // full, lose the oldest
+        link->event_head = (link->event_head + 1) % TVLINK_EVENT_QUEUE;
+        link->event_count--;
+    }
+    link->events[(link->event_head + link->event_count) % TVLINK_EVENT_QUEUE] = *event;
+    link->event_count++;
+}
+
+int tvlink_request(struct tvlink *link, uint8_t type, const void *payload, uint8_t length,
+        struct tvlink_frame *response, int timeout_ms)
+{
+    long deadline = tvlink_now_ms() + timeout_ms;
+    uint8_t seq = link->seq++;
+    int r;
+
+    r = tvlink_send(link, seq, type, payload, length);
+    if(r < 0)
+        return r;
+
+    while(1){
+        r = tvlink_read_frame(link, response, deadline - tvlink_now_ms());
+        if(r < 0)
+            return r;
+        if(response->type & HP_EVENT)
+            tvlink_queue_event(link, response);
+        else if(response->type == (type | HP_RESPONSE) && response->seq == seq){
+            if(response->length < 1)
+                return -EPROTO;
+            return 0;
+        }
+        // otherwise a stale response to an earlier request; ignore it
+    }
+}
+
+int tvlink_read_event(struct tvlink *link, struct tvlink_frame *event, int timeout_ms)
+{
+    int r;
+
+    while(1){
+        if(link->event_count){
+            *event = link->events[link->event_head];
+            link->event_head = (link->event_head + 1) % TVLINK_EVENT_QUEUE;
+            link->event_count--;
+            return 0;
+        }
+        r = tvlink_read_frame(link, event, timeout_ms);
+        if(r < 0)
+            return r;
+        if(event->type & HP_EVENT)
+            return 0;
+    }
+}
+
+static int tvlink_simple(struct tvlink *link, uint8_t type, const void *payload, uint8_t length,
+        struct tvlink_frame *response)
+{
+    int r;
+
+    r = tvlink_request(link, type, payload, length, response, TVLINK_TIMEOUT_MS);
+    if(r < 0)
+        return r;
+
+    switch(response->payload[0]){
+        case HP_OK:         return 0;
+        case HP_ERR_TYPE:   return -ENOSYS;
+        case HP_ERR_ARG:    return -EINVAL;
+        case HP_ERR_STATE:  return -EBUSY;
+    }
+    return -EPROTO;
+}
+
+int tvlink_ping(struct tvlink *link)
+{
+    struct tvlink_frame response;
+
+    return tvlink_simple(link, HP_PING, NULL, 0, &response);
+}
+
+int tvlink_get_status(struct tvlink *link, struct tvlink_status *status)
+{
+    struct tvlink_frame response;
+    const uint8_t *p = &response.payload[1];
+    int r;
+
+    r = tvlink_simple(link, HP_GET_STATUS, NULL, 0, &response);
+    if(r < 0)
+        return r;
+    if(response.length < 1 + HP_STATUS_LENGTH)
+        return -EPROTO;
+
+    status->amp_on = p[HP_STATUS_AMP];
+    status->dac_on = p[HP_STATUS_DAC];
+    status->volume_known = p[HP_STATUS_VOLUME_KNOWN];
+    status->volume = p[HP_STATUS_VOLUME];
+    status->predict_enabled = p[HP_STATUS_PREDICT];
+    status->uptime_ms = p[HP_STATUS_UPTIME] | (p[HP_STATUS_UPTIME+1] << 8) |
+        (p[HP_STATUS_UPTIME+2] << 16) | ((uint32_t)p[HP_STATUS_UPTIME+3] << 24);
+
+    return 0;
+}
+
+int tvlink_get_stats(struct tvlink *link, uint16_t *counters, int max_counters)
+{
+    struct tvlink_frame response;
+    int r, n;
+
+    r = tvlink_simple(link, HP_GET_STATS, NULL, 0, &response);
+    if(r < 0)
+        return r;
+
+    n = (response.length - 1) / 2;
+    if(n > max_counters)
+        n = max_counters;
+    for(int i=0; i<n; i++)
+        counters[i] = response.payload[1 + 2*i] | (response.payload[2 + 2*i] << 8);
+
+    return n;
+}
+
+int tvlink_amp(struct tvlink *link, uint8_t action)
+{
+    struct tvlink_frame response;
+
+    return tvlink_simple(link, HP_AMP, &action, 1, &response);
+}
+
+int tvlink_volume(struct tvlink *link, uint8_t action, uint8_t level)
+{
+    struct tvlink_frame response;
+    uint8_t payload[2] = { action, level };
+
+    return tvlink_simple(link, HP_VOLUME, payload, (action == HP_VOLUME_SET) ? 2 : 1, &response);
+}
+
+int tvlink_subscribe(struct tvlink *link, uint8_t mask)
+{
+    struct tvlink_frame response;
+
+    return tvlink_simple(link, HP_SUBSCRIBE, &mask, 1, &response);
+}
+
+int tvlink_scene(struct tvlink *link, uint8_t scene)
+{
+    struct tvlink_frame response;
+
+    return tvlink_simple(link, HP_SCENE, &scene, 1, &response);
+}
+
+int tvlink_scene_write(struct tvlink *link, uint8_t offset, const void *data, int length)
+{
+    struct tvlink_frame response;
+    uint8_t payload[HP_MAX_PAYLOAD];
+    int chunk, done, r;
+
+    for(done=0; done<length; done+=chunk){
+        chunk = length - done;
+        if(chunk > 16)
+            chunk = 16;
+        payload[0] = offset + done;
+        memcpy(&payload[1], (const uint8_t*)data + done, chunk);
+        // the device is busy until the last chunk is in EEPROM (~3.4ms a byte)
+        for(int tries=0; tries<TVLINK_WRITE_TRIES; tries++){
+            r = tvlink_simple(link, HP_SCENE_WRITE, payload, chunk + 1, &response);
+            if(r != -EBUSY)
+                break;
+            usleep(20000);
+        }
+        if(r < 0)
+            return r;
+    }
+
+    return 0;
+}
+
+int tvlink_get_serial(struct tvlink *link, struct tvlink_serial *serial)
+{
+    struct tvlink_frame response;
+    const uint8_t *p = &response.payload[1];
+    int r;
+
+    r = tvlink_simple(link, HP_GET_SERIAL, NULL, 0, &response);
+    if(r < 0)
+        return r;
+    if(response.length < 1 + 12)
+        return -EPROTO;
+
+    serial->baud = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    serial->framing_errors = p[4] | (p[5] << 8);
+    serial->overrun_errors = p[6] | (p[7] << 8);
+    serial->parity_errors = p[8] | (p[9] << 8);
+    serial->buffer_overflows = p[10] | (p[11] << 8);
+
+    return 0;
+}
+
+int tvlink_set_baud(struct tvlink *link, int baud)
+{
+    struct tvlink_frame response;
+    uint8_t payload[4] = { baud, baud >> 8, baud >> 16, baud >> 24 };
+    int old_baud = link->baud;
+    long switched, wait;
+    int r;
+
+    if(!tvlink_speed(baud))
+        return -EINVAL;
+
+    // the device answers at the old rate, then switches once that has gone
+    r = tvlink_simple(link, HP_SET_BAUD, payload, sizeof(payload), &response);
+    if(r < 0)
+        return r;
+    switched = tvlink_now_ms();
+    r = tvlink_set_speed(link, baud);
+    if(r < 0)
+        return r;
+
+    // any good frame at the new rate confirms it, otherwise the device goes back
+    for(int i=0; i<TVLINK_BAUD_TRIES; i++){
+        r = tvlink_ping(link);
+        if(r == 0)
+            return 0;
+    }
+
+    // the device goes back to the old rate once it gives up waiting for us
+    tvlink_set_speed(link, old_baud);
+    wait = switched + HP_BAUD_CONFIRM_MS + TVLINK_TIMEOUT_MS - tvlink_now_ms();
+    if(wait > 0)
+        usleep(wait * 1000L);
+    return r;
+}
+
+/* vim:set shiftwidth=4 expandtab: */
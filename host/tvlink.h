@@ -0,0 +1,86 @@
+#ifndef __TVLINK_DOT_H__
+#define __TVLINK_DOT_H__
+
+/* Host side client library for the binary control protocol, see hostproto.h */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../hostproto.h"
+
+#define TVLINK_TIMEOUT_MS   500     // default time to wait for a response
+#define TVLINK_EVENT_QUEUE  16      // events held while waiting for a response
+#define TVLINK_BAUD_TRIES   3       // pings at a new baud rate before giving up
+#define TVLINK_WRITE_TRIES  25      // HP_SCENE_WRITE retries while the device is busy
+#define TVLINK_BOOT_MS      3000    // bootloader plus start up, after open() resets the device
+#define TVLINK_QUIET_MS     200     // start up is over once its console text stops
+
+struct tvlink_frame {
+    uint8_t type;
+    uint8_t seq;
+    uint8_t length;
+    uint8_t payload[HP_MAX_PAYLOAD];
+};
+
+struct tvlink_status {
+    bool amp_on;
+    bool dac_on;
+    bool volume_known;
+    uint8_t volume;
+    bool predict_enabled;
+    uint32_t uptime_ms;
+};
+
+struct tvlink_serial {
+    uint32_t baud;
+    uint16_t framing_errors;
+    uint16_t overrun_errors;
+    uint16_t parity_errors;
+    uint16_t buffer_overflows;
+};
+
+struct tvlink {
+    int fd;
+    int baud;
+    uint8_t seq;
+    bool verbose;               // copy console text to stderr
+    // receive state
+    uint8_t buffer[HP_OVERHEAD + HP_MAX_PAYLOAD];
+    int buffered;
+    // events received while waiting for a response
+    struct tvlink_frame events[TVLINK_EVENT_QUEUE];
+    int event_head, event_count;
+};
+
+// all functions returning int give 0 on success, or a negative errno value
+
+// Opening the port asserts DTR, which resets an Arduino unless DTR was left
+// asserted by the last close. tvlink clears HUPCL so that it is, and only
+// the first open after plugging in (or after a program which drops DTR)
+// resets the device; tvlink_open() then waits for it to start.
+int tvlink_open(struct tvlink *link, const char *device, int baud);
+void tvlink_close(struct tvlink *link);
+
+// send a request and wait for its response; response->payload[0] is the status
+int tvlink_request(struct tvlink *link, uint8_t type, const void *payload, uint8_t length,
+        struct tvlink_frame *response, int timeout_ms);
+
+// wait for the next event frame (timeout_ms < 0 waits forever)
+int tvlink_read_event(struct tvlink *link, struct tvlink_frame *event, int timeout_ms);
+
+int tvlink_ping(struct tvlink *link);
+int tvlink_get_status(struct tvlink *link, struct tvlink_status *status);
+int tvlink_get_stats(struct tvlink *link, uint16_t *counters, int max_counters); // returns number of counters
+int tvlink_amp(struct tvlink *link, uint8_t action);
+int tvlink_volume(struct tvlink *link, uint8_t action, uint8_t level);
+int tvlink_subscribe(struct tvlink *link, uint8_t mask);
+int tvlink_scene(struct tvlink *link, uint8_t scene); // or HP_SCENE_STOP
+int tvlink_scene_write(struct tvlink *link, uint8_t offset, const void *data, int length);
+int tvlink_get_serial(struct tvlink *link, struct tvlink_serial *serial);
+// Switch both ends to a new baud rate. If the device can't be reached at the
+// new rate, this waits out HP_BAUD_CONFIRM_MS (the device's fallback) so the
+// link is back at the old rate when it returns the error.
+int tvlink_set_baud(struct tvlink *link, int baud);
+
+uint16_t tvlink_crc_update(uint16_t crc, uint8_t data);
+
+#endif
@@ -0,0 +1,151 @@
+#include <stdbool.h>
+#include <avr/io.h>
+#include <util/crc16.h>
+#include "serial.h"
+#include "timer.h"
+#include "journal.h"
+#include "hostlink.h"
+
+/*
+   Binary framed protocol for host automation, alongside the human console.
+   See hostproto.h for the frame format.
+*/
+
+#define HOSTLINK_TIMEOUT_MS  100    // give up on a partly received frame
+#define HOSTLINK_STATS_MS    10000  // how often to send HP_EVENT_STATS
+
+enum {
+    RX_IDLE,
+    RX_SYNC2,
+    RX_LENGTH,
+    RX_SEQ,
+    RX_TYPE,
+    RX_PAYLOAD,
+    RX_CRC_LOW,
+    RX_CRC_HIGH
+};
+
+static uint8_t rx_state = RX_IDLE;
+static uint8_t rx_length, rx_seq, rx_type, rx_count;
+static uint8_t rx_payload[HP_MAX_PAYLOAD];
+static uint16_t rx_crc;
+static uint32_t rx_start_ms;
+
+static uint8_t subscribed;
+static uint8_t event_seq;
+static uint32_t stats_ms;
+
+bool hostlink_receive(uint8_t byte)
+{
+    switch(rx_state){
+        case RX_IDLE:
+            if(byte != HP_SYNC1)
+                return false;   // not ours, let the console have it
+            rx_start_ms = timer_millis();
+            rx_state = RX_SYNC2;
+            return true;
+        case RX_SYNC2:
+            rx_state = (byte == HP_SYNC2) ? RX_LENGTH : RX_IDLE;
+            return true;
+        case RX_LENGTH:
+            if(byte > HP_MAX_PAYLOAD){
+                rx_state = RX_IDLE;
+                return true;
+            }
+            rx_length = byte;
+            rx_crc = _crc_ccitt_update(0xFFFF, byte);
+            rx_state = RX_SEQ;
+            return true;
+        case RX_SEQ:
+            rx_seq = byte;
+            rx_crc = _crc_ccitt_update(rx_crc, byte);
+            rx_state = RX_TYPE;
+            return true;
+        case RX_TYPE:
+            rx_type = byte;
+            rx_crc = _crc_ccitt_update(rx_crc, byte);
+            rx_count = 0;
+            rx_state = rx_length ? RX_PAYLOAD : RX_CRC_LOW;
+            return true;
+        case RX_PAYLOAD:
+            rx_payload[rx_count++] = byte;
+            rx_crc = _crc_ccitt_update(rx_crc, byte);
+            if(rx_count == rx_length)
+                rx_state = RX_CRC_LOW;
+            return true;
+        case RX_CRC_LOW:
+            rx_crc ^= byte;
+            rx_state = RX_CRC_HIGH;
+            return true;
+        case RX_CRC_HIGH:
+            rx_crc ^= (uint16_t)byte << 8;
+            rx_state = RX_IDLE;
+            if(rx_crc == 0){
+                serial_baud_confirm(); // a good frame, so the host is at our rate
+                if(rx_type == HP_SUBSCRIBE && rx_length == 1){
+                    subscribed = rx_payload[0];
+                    hostlink_respond(rx_seq, rx_type, HP_OK, 0, 0);
+                }else
+                    hostlink_request(rx_seq, rx_type, rx_payload, rx_length);
+            }
+            return true;
+    }
+
+    rx_state = RX_IDLE;
+    return false;
+}
+
+static void hostlink_send(uint8_t seq, uint8_t type, uint8_t status, bool send_status,
+        const uint8_t *data, uint8_t length)
+{
+    uint8_t header[3] = { length + (send_status ? 1 : 0), seq, type };
+    uint16_t crc = 0xFFFF;
+
+    serial_write_byte(HP_SYNC1);
+    serial_write_byte(HP_SYNC2);
+    for(uint8_t i=0; i<sizeof(header); i++){
+        crc = _crc_ccitt_update(crc, header[i]);
+        serial_write_byte(header[i]);
+    }
+    if(send_status){
+        crc = _crc_ccitt_update(crc, status);
+        serial_write_byte(status);
+    }
+    for(uint8_t i=0; i<length; i++){
+        crc = _crc_ccitt_update(crc, data[i]);
+        serial_write_byte(data[i]);
+    }
+    serial_write_byte(crc & 0xFF);
+    serial_write_byte(crc >> 8);
+}
+
+void hostlink_respond(uint8_t seq, uint8_t type, uint8_t status, const void *data, uint8_t length)
+{
+    // the status byte counts against HP_MAX_PAYLOAD; the host would drop anything longer
+    if(length > HP_MAX_RESPONSE){
+        status = HP_ERR_STATE;
+        length = 0;
+    }
+    hostlink_send(seq, type | HP_RESPONSE, status, true, data, length);
+}
+
+void hostlink_event(uint8_t sub, uint8_t type, const void *data, uint8_t length)
+{
+    if(subscribed & sub)
+        hostlink_send(event_seq++, type, 0, false, data, length);
+}
+
+void hostlink_periodic(void)
+{
+    uint32_t now = timer_millis();
+
+    if(rx_state != RX_IDLE && (now - rx_start_ms) >= HOSTLINK_TIMEOUT_MS)
+        rx_state = RX_IDLE;
+
+    if((now - stats_ms) >= HOSTLINK_STATS_MS){
+        stats_ms = now;
+        hostlink_event(HP_SUB_STATS, HP_EVENT_STATS, journal_counter, sizeof(journal_counter));
+    }
+}
+
+/* vim:set shiftwidth=4 expandtab: */
@@ -0,0 +1,16 @@
+#ifndef __HOSTLINK_DOT_H__
+#define __HOSTLINK_DOT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hostproto.h"
+
+bool hostlink_receive(uint8_t byte); // returns true if the byte was part of a frame
+void hostlink_periodic(void);
+void hostlink_respond(uint8_t seq, uint8_t type, uint8_t status, const void *data, uint8_t length);
+void hostlink_event(uint8_t sub, uint8_t type, const void *data, uint8_t length);
+
+// provided by main.c: carry out a request and call hostlink_respond()
+void hostlink_request(uint8_t seq, uint8_t type, const uint8_t *payload, uint8_t length);
+
+#endif
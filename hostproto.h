@@ -0,0 +1,86 @@
+#ifndef __HOSTPROTO_DOT_H__
+#define __HOSTPROTO_DOT_H__
+
+/*
+   Binary host control protocol, shared by the firmware and the host library.
+
+   Frames are sent on the same serial port as the human console:
+
+     0xA5 0x5A <length> <seq> <type> <payload: length bytes> <crc low> <crc high>
+
+   The CRC is CRC-16/CCITT as computed by avr-libc's _crc_ccitt_update()
+   (reflected polynomial 0x8408, initial value 0xFFFF) over the length, seq,
+   type and payload bytes. Multi-byte values are little endian.
+
+   The console only ever sends ASCII, so the 0xA5 sync byte can't appear in
+   its text; the host skips anything which isn't a frame with a good CRC.
+
+   Requests come from the host. Each is answered by a response with the same
+   seq and the request type with HP_RESPONSE set, whose first payload byte is
+   a status code. Events are sent by the device once the host subscribes to
+   them, with their own incrementing seq.
+
+   HP_SET_BAUD is answered at the old rate, then the device switches. The
+   host must switch too and send any request (eg HP_PING) at the new rate
+   within HP_BAUD_CONFIRM_MS, otherwise the device goes back to the old rate.
+   After a reset the device always starts at the Makefile's SERIAL_BAUD.
+*/
+
+#define HP_SYNC1        0xA5
+#define HP_SYNC2        0x5A
+#define HP_MAX_PAYLOAD  32
+#define HP_MAX_RESPONSE (HP_MAX_PAYLOAD - 1) // data in a response, after the status byte
+#define HP_OVERHEAD     7       // sync x2, length, seq, type, crc x2
+#define HP_BAUD_CONFIRM_MS 10000 // see HP_SET_BAUD
+
+#define HP_RESPONSE     0x80    // set in the type of responses
+#define HP_EVENT        0x40    // set in the type of events
+
+// requests
+#define HP_PING         0x01    // no payload; response: none
+#define HP_GET_STATUS   0x02    // no payload; response: struct hp_status
+#define HP_AMP          0x03    // payload: HP_AMP_*
+#define HP_VOLUME       0x04    // payload: HP_VOLUME_*, level (for HP_VOLUME_SET)
+#define HP_GET_STATS    0x05    // no payload; response: uint16 counters, COUNTER_* order in journal.h
+#define HP_SUBSCRIBE    0x06    // payload: mask of HP_SUB_* events to send
+#define HP_SCENE        0x07    // payload: scene number to run, or HP_SCENE_STOP
+#define HP_SCENE_WRITE  0x08    // payload: offset, bytes to write to scene EEPROM; HP_ERR_STATE while a write is in progress
+#define HP_SET_BAUD     0x09    // payload: uint32 baud; see below
+#define HP_GET_SERIAL   0x0A    // no payload; response: uint32 baud, uint16 counters, SERIAL_ERROR_* order in serial.h
+
+// events
+#define HP_EVENT_IR     0x41    // payload: address, command, toggle
+#define HP_EVENT_POWER  0x42    // payload: amp on, DAC on
+#define HP_EVENT_STATS  0x43    // payload: as HP_GET_STATS response, without status
+
+#define HP_SUB_IR       0x01
+#define HP_SUB_POWER    0x02
+#define HP_SUB_STATS    0x04
+
+// response status codes
+#define HP_OK           0x00
+#define HP_ERR_TYPE     0x01    // unknown request type
+#define HP_ERR_ARG      0x02    // bad length or argument
+#define HP_ERR_STATE    0x03    // can't do that right now
+
+#define HP_AMP_OFF          0
+#define HP_AMP_ON           1
+#define HP_AMP_OFF_DELAYED  2
+
+#define HP_VOLUME_DOWN      0
+#define HP_VOLUME_UP        1
+#define HP_VOLUME_MUTE      2
+#define HP_VOLUME_SET       3
+
+#define HP_SCENE_STOP       0xFF    // stop all running scenes
+
+// HP_GET_STATUS response payload, after the status byte
+#define HP_STATUS_AMP           0   // amp LED on
+#define HP_STATUS_DAC           1   // DAC trigger on
+#define HP_STATUS_VOLUME_KNOWN  2
+#define HP_STATUS_VOLUME        3
+#define HP_STATUS_PREDICT       4   // predictive power on enabled
+#define HP_STATUS_UPTIME        5   // uint32 milliseconds
+#define HP_STATUS_LENGTH        9
+
+#endif
@@ -0,0 +1,298 @@
+#include <stdbool.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include "debug.h"
+#include "timer.h"
+#include "journal.h"
+#include "sched.h"
+
+/*
+   Records are written round a ring in EEPROM, so each slot is only rewritten
+   once per trip round the ring. Every record carries a sequence number; the
+   newest record is the one whose successor does not continue the sequence.
+
+   Records are queued in RAM and written a byte at a time from the EEPROM
+   ready interrupt, so logging never waits for the ~3.4ms EEPROM write time.
+   The sequence number is written last, so a record torn by a reset breaks
+   the sequence and is treated as the end of the ring.
+
+   Records are timestamped with operating minutes: time spent running, added
+   up across resets. Only the low 16 bits fit in a record, so a JOURNAL_UPTIME
+   record carries the high 16 bits. One is logged at every start and whenever
+   the high bits change. A snapshot also logs one when nothing else has been
+   logged for a snapshot period. At start up we carry on from the newest
+   record, so a reset loses at most the time since then.
+*/
+
+struct journal_record {
+    uint16_t seq;           // sequence number, never 0xFFFF (erased)
+    uint8_t type;
+    uint8_t arg;
+    uint16_t minutes;       // low 16 bits of operating minutes when logged
+    uint16_t value;
+};
+
+#define JOURNAL_SLOTS        ((JOURNAL_EEPROM_END - JOURNAL_EEPROM_START) / sizeof(struct journal_record))
+#define JOURNAL_QUEUE_LENGTH 8
+#define JOURNAL_SNAPSHOT_MS  (6UL * 60UL * 60UL * 1000UL) // six hours
+#define JOURNAL_MINUTE_MS    60000UL
+#define JOURNAL_DUMP_RECORDS 2                  // ~80ms at 9600 baud
+#define JOURNAL_ERASED       0xFFFF
+
+uint16_t journal_counter[NUM_COUNTERS];
+
+static uint16_t snapshot_counter[NUM_COUNTERS];
+static uint32_t snapshot_ms;
+static bool logged_since_snapshot;
+
+static uint32_t minutes;                        // operating minutes, see above
+static uint32_t minute_ms;                      // timer_millis() at the start of this minute
+static uint16_t uptime_logged;                  // minutes >> 16 in the last JOURNAL_UPTIME
+
+static uint8_t dump_slot, dump_left;            // journal_dump() in progress
+static uint16_t dump_high, dump_low;
+
+static struct journal_record queue[JOURNAL_QUEUE_LENGTH];
+static uint8_t queue_slot[JOURNAL_QUEUE_LENGTH];
+static volatile uint8_t queue_head, queue_tail; // ISR writes from head, journal_log() adds at tail
+static uint8_t write_offset;                    // byte of queue[queue_head] being written
+
+static uint8_t next_slot;
+static uint16_t next_seq;
+
+static uint16_t seq_next(uint16_t seq)
+{
+    seq++;
+    if(seq == JOURNAL_ERASED)
+        seq = 0;
+    return seq;
+}
+
+static uint16_t slot_address(uint8_t slot)
+{
+    return JOURNAL_EEPROM_START + (slot * sizeof(struct journal_record));
+}
+
+static void read_record(uint8_t slot, struct journal_record *rec)
+{
+    eeprom_read_block(rec, (const void *)(uintptr_t)slot_address(slot), sizeof(struct journal_record));
+}
+
+/* Carry on counting operating minutes from the newest record, taking the
+   high bits from the newest JOURNAL_UPTIME record. */
+static void find_minutes(void)
+{
+    struct journal_record rec;
+    uint8_t slot = next_slot;
+    uint16_t low = 0, high = 0;
+
+    for(uint8_t i=0; i<JOURNAL_SLOTS; i++){
+        slot = slot ? (slot - 1) : (JOURNAL_SLOTS - 1);
+        read_record(slot, &rec);
+        if(rec.seq == JOURNAL_ERASED)
+            break;
+        if(i == 0)
+            low = rec.minutes;
+        if(rec.type == JOURNAL_UPTIME){
+            high = rec.value;
+            if(low < rec.minutes) // the low bits wrapped since
+                high++;
+            break;
+        }
+    }
+
+    minutes = ((uint32_t)high << 16) | low;
+}
+
+static void log_uptime(void)
+{
+    uptime_logged = minutes >> 16;
+    journal_log(JOURNAL_UPTIME, 0, uptime_logged);
+}
+
+void journal_init(void)
+{
+    struct journal_record rec;
+    uint16_t seq;
+    uint8_t slot;
+
+    // called before the EEPROM interrupt is in use, so reads can't collide with writes
+    read_record(0, &rec);
+    if(rec.seq == JOURNAL_ERASED){
+        next_slot = 0;
+        next_seq = 0;
+    }else{
+        seq = rec.seq;
+        for(slot=1; slot<JOURNAL_SLOTS; slot++){
+            read_record(slot, &rec);
+            if(rec.seq != seq_next(seq))
+                break;
+            seq = rec.seq;
+        }
+        next_slot = (slot == JOURNAL_SLOTS) ? 0 : slot;
+        next_seq = seq_next(seq);
+    }
+
+    find_minutes();
+    minute_ms = timer_millis();
+
+    report("Journal: %d slots, next %d, seq %u, %lu operating minutes\n",
+            JOURNAL_SLOTS, next_slot, next_seq, minutes);
+    log_uptime();
+}
+
+void journal_log(uint8_t type, uint8_t arg, uint16_t value)
+{
+    struct journal_record *rec;
+    uint8_t tail = queue_tail;
+    uint8_t next_tail = (tail + 1) % JOURNAL_QUEUE_LENGTH;
+
+    if(next_tail == queue_head){
+        journal_count(COUNTER_JOURNAL_DROPPED);
+        return; // queue full
+    }
+
+    rec = &queue[tail];
+    rec->seq = next_seq;
+    rec->type = type;
+    rec->arg = arg;
+    rec->minutes = minutes;
+    rec->value = value;
+    queue_slot[tail] = next_slot;
+    logged_since_snapshot = true;
+
+    next_seq = seq_next(next_seq);
+    if(++next_slot == JOURNAL_SLOTS)
+        next_slot = 0;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        queue_tail = next_tail;
+        EECR |= _BV(EERIE); // start writing if we're not already
+    }
+}
+
+void journal_snapshot(void)
+{
+    for(uint8_t i=0; i<NUM_COUNTERS; i++){
+        if(journal_counter[i] != snapshot_counter[i]){
+            snapshot_counter[i] = journal_counter[i];
+            journal_log(JOURNAL_COUNTER, i, snapshot_counter[i]);
+        }
+    }
+}
+
+static const char journal_type_names[] PROGMEM =
+    "?\0reset\0amp on\0amp off\0DAC on\0DAC off\0predict timeout\0counter\0uptime\0";
+
+static PGM_P journal_type_name(uint8_t type)
+{
+    PGM_P name = journal_type_names;
+
+    if(type > JOURNAL_UPTIME)
+        type = 0;
+    while(type--)
+        name += strlen_P(name) + 1;
+    return name;
+}
+
+/* The dump is printed a few records per scheduler pass, since at 9600 baud
+   the whole journal takes about four seconds to send. */
+void journal_dump(void)
+{
+    dump_slot = next_slot;
+    dump_left = JOURNAL_SLOTS;
+    dump_high = dump_low = 0;
+    report("Journal (oldest first):\n");
+    sched_wake(TASK_JOURNAL);
+}
+
+static void journal_dump_some(void)
+{
+    struct journal_record rec;
+
+    // wait for the queue to drain so the EEPROM interrupt is idle while we read
+    if(queue_head != queue_tail){
+        sched_wake(TASK_JOURNAL);
+        return;
+    }
+
+    for(uint8_t n=0; n<JOURNAL_DUMP_RECORDS && dump_left; n++, dump_left--){
+        read_record(dump_slot, &rec);
+        if(rec.seq != JOURNAL_ERASED){
+            if(rec.type == JOURNAL_UPTIME)
+                dump_high = rec.value;
+            else if(rec.minutes < dump_low)
+                dump_high++;
+            dump_low = rec.minutes;
+            report("%5u %7lu min %S arg %d value %u\n", rec.seq, ((uint32_t)dump_high << 16) | dump_low,
+                    journal_type_name(rec.type), rec.arg, rec.value);
+        }
+        if(++dump_slot == JOURNAL_SLOTS)
+            dump_slot = 0;
+    }
+
+    if(dump_left)
+        sched_wake(TASK_JOURNAL);
+}
+
+void journal_periodic(void)
+{
+    uint32_t now = timer_millis();
+
+    if(dump_left)
+        journal_dump_some();
+
+    // counted here rather than from timer_millis(), which wraps after 49 days
+    while((now - minute_ms) >= JOURNAL_MINUTE_MS){
+        minute_ms += JOURNAL_MINUTE_MS;
+        minutes++;
+    }
+    if((minutes >> 16) != uptime_logged)
+        log_uptime();
+
+    if((now - snapshot_ms) >= JOURNAL_SNAPSHOT_MS){
+        snapshot_ms = now;
+        if(!logged_since_snapshot)
+            log_uptime();
+        logged_since_snapshot = false;
+        journal_snapshot();
+    }
+}
+
+ISR(EE_READY_vect)
+{
+    const uint8_t *rec;
+    uint16_t address;
+    uint8_t offset;
+
+    if(queue_head == queue_tail){
+        EECR &= ~_BV(EERIE); // nothing left to write
+        return;
+    }
+
+    // write bytes 2..7 then the sequence number in bytes 0..1
+    offset = (write_offset + 2) % sizeof(struct journal_record);
+    rec = (const uint8_t*)&queue[queue_head];
+    address = slot_address(queue_slot[queue_head]) + offset;
+
+    if(++write_offset == sizeof(struct journal_record)){
+        write_offset = 0;
+        queue_head = (queue_head + 1) % JOURNAL_QUEUE_LENGTH;
+    }
+
+    // skip bytes which already hold the right value; this interrupt fires
+    // again straight away since the EEPROM is still ready
+    EEAR = address;
+    EECR |= _BV(EERE);
+    if(EEDR == rec[offset])
+        return;
+
+    EEDR = rec[offset];
+    EECR |= _BV(EEMPE);
+    EECR |= _BV(EEPE);
+}
+
+/* vim:set shiftwidth=4 expandtab: */
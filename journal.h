@@ -0,0 +1,47 @@
+#ifndef __JOURNAL_DOT_H__
+#define __JOURNAL_DOT_H__
+
+#include <stdint.h>
+
+/* The journal is a ring of fixed size records in EEPROM. The low 256 bytes
+   of EEPROM are left free for settings; the journal uses the rest. */
+#define JOURNAL_EEPROM_START 0x100
+#define JOURNAL_EEPROM_END   (E2END + 1)
+
+// record types
+enum {
+    JOURNAL_RESET = 1,      // arg: MCUSR reset flags (0 if unknown), value: task the watchdog fired in | JOURNAL_RESET_WARM
+    JOURNAL_AMP_ON,
+    JOURNAL_AMP_OFF,
+    JOURNAL_DAC_ON,
+    JOURNAL_DAC_OFF,
+    JOURNAL_PREDICT_TIMEOUT,
+    JOURNAL_COUNTER,        // arg: counter number, value: counter
+    JOURNAL_UPTIME,         // value: operating minutes >> 16, see journal.c
+    JOURNAL_EMPTY = 0xFF
+};
+
+#define JOURNAL_RESET_WARM 0x100 // state was restored after the reset
+
+// counters, snapshotted into the journal when they change
+enum {
+    COUNTER_RC5_FRAMES,
+    COUNTER_RC5_ERRORS,
+    COUNTER_NEC_FRAMES,
+    COUNTER_AMP_ON,
+    COUNTER_AMP_OFF,
+    COUNTER_JOURNAL_DROPPED,
+    NUM_COUNTERS
+};
+
+extern uint16_t journal_counter[NUM_COUNTERS];
+
+void journal_init(void);
+void journal_periodic(void);
+void journal_log(uint8_t type, uint8_t arg, uint16_t value);
+void journal_snapshot(void); // log any counters that changed since the last snapshot
+void journal_dump(void);
+
+#define journal_count(counter) do { journal_counter[counter]++; } while(0)
+
+#endif
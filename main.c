@@ -6,13 +6,18 @@
 #include <util/delay.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
-#include <avr/wdt.h>
 #include "debug.h"
 #include "serial.h"
 #include "rc5.h"
 #include "necir.h"
 #include "version.h"
 #include "pins.h"
+#include "timer.h"
+#include "journal.h"
+#include "sched.h"
+#include "hostlink.h"
+#include "warm.h"
+#include "scene.h"
 
 /* pins
  * D9  (PB1) - relay coil (via NPN transistor)
@@ -38,7 +43,8 @@
 
 /* -- User LED -- */
 
-uint16_t user_led_off_timer = 0;
+uint16_t user_led_off_timer = 0;     // milliseconds until the LED goes off
+uint32_t user_led_timer_ms;
 
 static void user_led_off(void)
 {
@@ -47,9 +53,16 @@ static void user_led_off(void)
 
 static void check_user_led(void)
 {
+    uint32_t now = timer_millis();
+    uint32_t elapsed = now - user_led_timer_ms;
+
+    user_led_timer_ms = now;
     if(user_led_off_timer){
-        if(--user_led_off_timer == 0)
+        if(elapsed >= user_led_off_timer){
+            user_led_off_timer = 0;
             user_led_off();
+        }else
+            user_led_off_timer -= elapsed;
     }
 }
 
@@ -58,17 +71,43 @@ static void user_led_on(void)
     PORTB |= _BV(PIN_USER_LED);
 }
 
-static void user_led_on_timer(uint16_t ticks)
+static void user_led_on_timer(uint16_t ms)
 {
-    user_led_off_timer = ticks;
+    user_led_off_timer = ms;
+    user_led_timer_ms = timer_millis();
     user_led_on();
 }
 
 
 /* -- Amplifier power control -- */
 
+#define AMP_OFF_DELAY_MS 3000
+
 bool last_amp_power_on, last_dac_power_on;
-uint16_t amp_off_timer;
+uint16_t amp_off_timer;         // milliseconds until a delayed amp_off()
+uint32_t amp_off_timer_ms;
+
+/* Predictive power-on: the DAC 12V trigger only appears several seconds after
+ * the TV starts sending TOSLINK, and the amp has its own turn-on delay on top
+ * of that. When enabled we switch the amp on as soon as we see IR activity
+ * from the TV, and switch it back off if the DAC trigger never follows.
+ * Activity means a burst of edges, as any remote sends (an RC5 frame has 14
+ * or more in 25ms), so a stray edge from noise doesn't pulse the relay. */
+#define PREDICT_ENABLED_DEFAULT false
+#define PREDICT_TIMEOUT_MS      20000
+#define PREDICT_MIN_EDGES       10
+#define PREDICT_WINDOW_MS       100
+
+bool predict_enabled = PREDICT_ENABLED_DEFAULT;
+bool predict_pending;           // amp switched on early, waiting for DAC trigger
+uint32_t predict_start_ms;      // when the IR activity arrived
+uint8_t predict_edges;          // IR edges seen since predict_edges_ms
+uint32_t predict_edges_ms;
+bool amp_on_pending;            // relay pulsed, waiting for the amp LED
+uint32_t amp_on_ms;             // when the relay was pulsed to switch on
+uint32_t amp_led_on_ms;         // when the amp LED last came on
+uint32_t dac_on_ms;             // when the DAC trigger last came on
+bool amp_off_after_ramp;        // amp_off() once the volume ramp down completes
 
 static void relay_on(void)
 {
@@ -103,10 +142,22 @@ static void amp_on(void)
     _delay_ms(100);
     relay_off();
     amp_off_timer = 0;
+    amp_off_after_ramp = false;
+    amp_on_pending = true;
+    amp_on_ms = timer_millis();
+}
+
+/* An explicit request (console, host or scene) takes the amp over from the
+ * predictive power on, so its timeout mustn't switch it back off. */
+static void amp_on_requested(void)
+{
+    predict_pending = false;
+    amp_on();
 }
 
 static void amp_off(void)
 {
+    predict_pending = false;
     if(!is_amp_powered_on()){
         report("Amplifier: already OFF\n");
         return;
@@ -125,39 +176,103 @@ static void amp_off_delay(void)
         return;
     }
     report("Amplifier: delayed off ...\n");
-    amp_off_timer = 30000; // a bit more than 0.1 millisecond each
+    amp_off_timer = AMP_OFF_DELAY_MS;
+    amp_off_timer_ms = timer_millis();
+}
+
+static void check_predictive_power(void)
+{
+    uint32_t now = timer_millis();
+    uint8_t edges;
+
+    // always consume the activity count so stale edges don't trigger us later
+    edges = RC5_ActivityDetected();
+    if(edges){
+        if((now - predict_edges_ms) >= PREDICT_WINDOW_MS){
+            predict_edges = 0;
+            predict_edges_ms = now;
+        }
+        predict_edges = (edges > 0xff - predict_edges) ? 0xff : predict_edges + edges;
+    }
+
+    if(predict_edges >= PREDICT_MIN_EDGES && predict_enabled && !predict_pending &&
+            !is_dac_powered_on() && !is_amp_powered_on()){
+        predict_edges = 0;
+        report("Predictive: IR activity, amplifier on early\n");
+        amp_on();
+        predict_pending = true;
+        predict_start_ms = now;
+    }
+
+    if(predict_pending && (now - predict_start_ms) >= PREDICT_TIMEOUT_MS){
+        report("Predictive: no DAC trigger after %lu ms\n", now - predict_start_ms);
+        journal_log(JOURNAL_PREDICT_TIMEOUT, 0, 0);
+        amp_off();
+    }
+}
+
+static void power_event(void)
+{
+    uint8_t event[2] = { last_amp_power_on, last_dac_power_on };
+
+    hostlink_event(HP_SUB_POWER, HP_EVENT_POWER, event, sizeof(event));
 }
 
 static void check_amp_power(void)
 {
     bool amp_power_on, dac_power_on;
+    uint32_t now = timer_millis();
 
     amp_power_on = is_amp_powered_on();
     if(amp_power_on != last_amp_power_on){
         report("Power amp is %s\n", amp_power_on?"ON":"OFF");
         last_amp_power_on = amp_power_on;
+        if(amp_power_on){
+            amp_led_on_ms = now;
+            journal_count(COUNTER_AMP_ON);
+            if(amp_on_pending){
+                report("Amplifier: LED on %lu ms after switch on\n", now - amp_on_ms);
+                journal_log(JOURNAL_AMP_ON, predict_pending, now - amp_on_ms);
+            }else
+                journal_log(JOURNAL_AMP_ON, predict_pending, 0);
+        }else{
+            journal_count(COUNTER_AMP_OFF);
+            journal_log(JOURNAL_AMP_OFF, 0, 0);
+        }
+        power_event();
+        amp_on_pending = false;
     }
 
     dac_power_on = is_dac_powered_on();
     if(dac_power_on != last_dac_power_on){
         report("DAC is %s\n", dac_power_on?"ON":"OFF");
         last_dac_power_on = dac_power_on;
+        journal_log(dac_power_on ? JOURNAL_DAC_ON : JOURNAL_DAC_OFF, 0, 0);
+        power_event();
         // when the DAC changes power state, do the same for the power amp
-        if(dac_power_on)
-            amp_on();
-        else
+        if(dac_power_on){
+            dac_on_ms = now;
+            if(predict_pending){
+                // the relay has already been pulsed; pulsing again could toggle it off
+                report("Predictive: DAC trigger %lu ms after IR activity", now - predict_start_ms);
+                if(amp_power_on)
+                    report(", amplifier ready %lu ms earlier\n", now - amp_led_on_ms);
+                else
+                    report(", amplifier not ready yet\n");
+                predict_pending = false;
+            }else
+                amp_on();
+        }else
             amp_off_delay();
     }
 
-    switch(amp_off_timer){
-        case 0: 
-            return;             // no timer running
-        case 1: 
-            amp_off();          // on the final cycle, turn it off 
-                                // fall through
-        default:
-            _delay_us(100);     // delay a little each loop
-            amp_off_timer--;    // decrement timer
+    if(amp_off_timer){
+        if((now - amp_off_timer_ms) >= amp_off_timer)
+            amp_off();          // clears amp_off_timer
+        else{
+            amp_off_timer -= (now - amp_off_timer_ms);
+            amp_off_timer_ms = now;
+        }
     }
 }
 
@@ -181,26 +296,193 @@ static void check_amp_power(void)
  * Gain:   0x11 0x08
  * Dim:    0x11 0x28
  */
+#define E70_ADDRESS     0x11
+#define E70_MUTE        0x60
+#define E70_VOLUME_UP   0x62
+#define E70_VOLUME_DOWN 0x68
+
+static void e70_send(uint8_t command)
+{
+    send_nec_ir(E70_ADDRESS, command);
+    journal_count(COUNTER_NEC_FRAMES);
+}
+
+/* The E70 only understands relative volume steps, so we keep an estimate of
+ * its level by counting the steps we send. The estimate is unknown until it
+ * has been synced, either by driving the volume all the way down to zero or
+ * by telling us the level currently shown on the E70 display. Steps are only
+ * sent (and counted) while the DAC is powered on, since it ignores IR in
+ * standby. */
+#define VOLUME_MAX              100     // steps sent to guarantee we reach zero
+#define VOLUME_STEP_MS          110     // one NEC frame period between steps
+#define VOLUME_RAMP_LEVEL       0       // level to ramp down to before amp off
+#define VOLUME_RESTORE_DELAY_MS 3000    // wait for the DAC to accept IR after power on
+
+bool volume_known;              // volume_level has been synced
+uint8_t volume_level;           // estimated E70 volume step
+uint8_t volume_target;          // level we are stepping towards
+uint8_t volume_after_sync;      // target to set once a sync reaches zero
+bool volume_syncing;            // driving down to zero to sync
+uint32_t volume_step_ms;        // when the last step was sent
+bool volume_ramp_enabled;       // ramp down before amp off, restore on power on
+bool volume_restore_pending;    // restore volume_restore_level at next power on
+uint8_t volume_restore_level;
+
+static void volume_step(bool up)
+{
+    volume_step_ms = timer_millis();
+    if(up){
+        e70_send(E70_VOLUME_UP);
+        if(volume_level < VOLUME_MAX)
+            volume_level++;
+    }else{
+        e70_send(E70_VOLUME_DOWN);
+        if(volume_level > 0)
+            volume_level--;
+    }
+}
+
+static void volume_stop(void)
+{
+    if(volume_syncing){
+        volume_syncing = false;
+        volume_known = false;   // interrupted before reaching zero
+    }
+    volume_target = volume_level;
+}
 
 static void vol_up(void)
 {
-    send_nec_ir(0x11, 0x62);
+    volume_stop(); // a key press overrides any set volume in progress
+    if(is_dac_powered_on()){
+        volume_step(true);
+        volume_target = volume_level;
+    }else
+        e70_send(E70_VOLUME_UP);
     report("+");
 }
 
 static void vol_down(void)
 {
-    send_nec_ir(0x11, 0x68);
+    volume_stop();
+    if(is_dac_powered_on()){
+        volume_step(false);
+        volume_target = volume_level;
+    }else
+        e70_send(E70_VOLUME_DOWN);
     report("-");
 }
 
 static void vol_mute(void)
 {
-    send_nec_ir(0x11, 0x60);
+    e70_send(E70_MUTE);
     report("[mute]");
 }
 
 
+static void volume_report(void)
+{
+    if(volume_known)
+        report("Volume: %d", volume_level);
+    else
+        report("Volume: unknown");
+    if(volume_target != volume_level)
+        report(" (%s %d)", volume_syncing ? "syncing, then" : "going to", volume_target);
+    report(", ramp %s\n", volume_ramp_enabled ? "on" : "off");
+}
+
+static void volume_sync(int level)
+{
+    volume_known = true;
+    if(level < 0){
+        // assume the worst and walk all the way down to zero
+        volume_level = VOLUME_MAX;
+        volume_target = 0;
+        volume_after_sync = 0;
+        volume_syncing = true;
+    }else{
+        volume_level = (level > VOLUME_MAX) ? VOLUME_MAX : level;
+        volume_target = volume_level;
+        volume_syncing = false;
+    }
+}
+
+static void volume_set(int level)
+{
+    if(level < 0 || level > VOLUME_MAX){
+        report("Volume: %d out of range 0-%d\n", level, VOLUME_MAX);
+        return;
+    }
+    if(!is_dac_powered_on()){
+        report("Volume: DAC is OFF\n");
+        return;
+    }
+    if(!volume_known)
+        volume_sync(-1);
+    if(volume_syncing)
+        volume_after_sync = level;
+    else
+        volume_target = level;
+    volume_report();
+}
+
+static void amp_off_ramped(void)
+{
+    if(volume_ramp_enabled && volume_known && !volume_syncing &&
+            is_dac_powered_on() && is_amp_powered_on() && volume_level > VOLUME_RAMP_LEVEL){
+        report("Amplifier: ramping volume down before OFF\n");
+        volume_restore_level = volume_level;
+        volume_restore_pending = true;
+        volume_target = VOLUME_RAMP_LEVEL;
+        amp_off_after_ramp = true;
+        return;
+    }
+    amp_off();
+}
+
+static void check_volume(void)
+{
+    uint32_t now = timer_millis();
+
+    if(volume_restore_pending && volume_known && !volume_syncing &&
+            is_amp_powered_on() && is_dac_powered_on() &&
+            (now - dac_on_ms) >= VOLUME_RESTORE_DELAY_MS){
+        volume_restore_pending = false;
+        if(!amp_off_after_ramp){
+            report("Volume: restoring %d\n", volume_restore_level);
+            volume_target = volume_restore_level;
+        }
+    }
+
+    if(volume_target == volume_level){
+        if(amp_off_after_ramp){
+            amp_off_after_ramp = false;
+            amp_off();
+        }
+        return;
+    }
+
+    if(!is_dac_powered_on()){
+        report("Volume: DAC is OFF, stopped at %d\n", volume_level);
+        volume_stop();
+        return; // amp_off_after_ramp is handled on the next pass
+    }
+
+    if((now - volume_step_ms) < VOLUME_STEP_MS)
+        return;
+
+    volume_step(volume_target > volume_level);
+
+    if(volume_target == volume_level){
+        if(volume_syncing){
+            volume_syncing = false;
+            volume_target = volume_after_sync;
+        }
+        volume_report();
+    }
+}
+
+
 /* -- Infrared RX Receiver -- */
 
 static void check_infrared_input(void)
@@ -211,11 +493,19 @@ static void check_infrared_input(void)
         RC5_Reset(); // prepare for next command
         if(RC5_GetStartBits(rc5_command) != 3){
             report("RC5 command: BAD -- %d start bits\n", RC5_GetStartBits(rc5_command));
+            journal_count(COUNTER_RC5_ERRORS);
         }else{
             bool report_msg = true;
 
+            uint8_t event[3] = {
+                RC5_GetAddressBits(rc5_command),
+                RC5_GetCommandBits(rc5_command),
+                RC5_GetToggleBit(rc5_command) };
+
+            journal_count(COUNTER_RC5_FRAMES);
+            hostlink_event(HP_SUB_IR, HP_EVENT_IR, event, sizeof(event));
             if(RC5_GetAddressBits(rc5_command) == 16){
-                user_led_on_timer(5000);
+                user_led_on_timer(250);
                 switch(RC5_GetCommandBits(rc5_command)){
                     case 17: vol_down(); report_msg = false; break;
                     case 16: vol_up();   report_msg = false; break;
@@ -223,6 +513,10 @@ static void check_infrared_input(void)
                 }
             }
 
+            if(report_msg && scene_trigger(RC5_GetAddressBits(rc5_command),
+                        RC5_GetCommandBits(rc5_command), RC5_GetToggleBit(rc5_command)))
+                report_msg = false;
+
             if(report_msg){
                 report("RC5 addr %d, cmd %d, tog %d\n",
                         RC5_GetAddressBits(rc5_command),
@@ -234,28 +528,233 @@ static void check_infrared_input(void)
 }
 
 
+/* -- Scenes -- */
+
+bool scene_condition(uint8_t condition)
+{
+    switch(condition){
+        case SC_COND_AMP_ON:        return is_amp_powered_on();
+        case SC_COND_AMP_OFF:       return !is_amp_powered_on();
+        case SC_COND_DAC_ON:        return is_dac_powered_on();
+        case SC_COND_DAC_OFF:       return !is_dac_powered_on();
+        case SC_COND_VOLUME_IDLE:   return volume_target == volume_level;
+    }
+    return false;
+}
+
+void scene_action(uint8_t opcode, const uint8_t *operands)
+{
+    switch(opcode){
+        case SC_AMP_ON:
+            amp_on_requested();
+            break;
+        case SC_AMP_OFF:
+            amp_off_ramped();
+            break;
+        case SC_AMP_OFF_DELAYED:
+            amp_off_delay();
+            break;
+        case SC_NEC:
+            // E70 volume steps go through the volume model so it stays in step
+            if(operands[0] == E70_ADDRESS && operands[1] == E70_VOLUME_UP)
+                vol_up();
+            else if(operands[0] == E70_ADDRESS && operands[1] == E70_VOLUME_DOWN)
+                vol_down();
+            else{
+                send_nec_ir(operands[0], operands[1]);
+                journal_count(COUNTER_NEC_FRAMES);
+            }
+            break;
+        case SC_VOLUME_SET:
+            volume_set(operands[0]);
+            break;
+    }
+}
+
+
 /* -- Serial Console Input -- */
 
-static void check_serial_input(void)
+/* Single key commands act immediately. Anything else is collected into a line
+ * and run as a word command when return is pressed. */
+#define CONSOLE_LINE_LENGTH 64
+
+char console_line[CONSOLE_LINE_LENGTH];
+uint8_t console_length;
+
+static int hex_digit(char c)
 {
-    int serial_in;
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Parse a whole argument as a decimal number in 0-max, so a typo or trailing
+ * junk is reported rather than read as 0. */
+static bool console_number(const char *text, long max, long *value)
+{
+    char *end;
+
+    *value = strtol(text, &end, 10);
+    if(end == text || *end || *value < 0 || *value > max){
+        report("Bad number \"%s\", expected 0-%ld\n", text, max);
+        return false;
+    }
+    return true;
+}
+
+// "scene write <offset> <hex bytes>"
+static void console_scene_write(char *args)
+{
+    uint8_t data[(CONSOLE_LINE_LENGTH - 12) / 2];
+    uint8_t length = 0;
+    int offset, high, low;
+
+    offset = strtol(args, &args, 0);
+    while(*args == ' ')
+        args++;
+    while(args[0] && length < sizeof(data)){
+        high = hex_digit(args[0]);
+        low = hex_digit(args[1]);
+        if(high < 0 || low < 0){
+            report("Scene: bad hex\n");
+            return;
+        }
+        data[length++] = (high << 4) | low;
+        args += 2;
+    }
+
+    if(scene_write_busy())
+        report("Scene: still writing, try again\n");
+    else if(offset < 0 || offset >= SCENE_EEPROM_SIZE || !scene_write(offset, data, length))
+        report("Scene: bad offset\n");
+    else
+        report("Scene: writing %d bytes at %d\n", length, offset);
+}
+
+static void serial_report(void)
+{
+    uint16_t errors[NUM_SERIAL_ERRORS];
+
+    serial_get_errors(errors);
+    report("Serial: %lu baud, errors: framing %u, overrun %u, parity %u, buffer full %u\n",
+            serial_baud(), errors[SERIAL_ERROR_FRAME], errors[SERIAL_ERROR_OVERRUN],
+            errors[SERIAL_ERROR_PARITY], errors[SERIAL_ERROR_BUFFER]);
+}
+
+// "baud <rate>": switch, and expect "baud" back at the new rate
+static void console_baud(uint32_t baud)
+{
+    if(!serial_baud_ok(baud)){
+        report("Serial: can't generate %lu baud accurately\n", baud);
+        return;
+    }
+    report("Serial: switching to %lu baud, type \"baud\" within %d seconds to keep it\n",
+            baud, SERIAL_BAUD_TIMEOUT_MS / 1000);
+    serial_set_baud(baud);
+}
+
+static void console_command(char *line)
+{
+    long number;
+
+    if(strncmp_P(line, PSTR("set volume "), 11) == 0){
+        if(console_number(line + 11, VOLUME_MAX, &number))
+            volume_set(number);
+    }else if(strcmp_P(line, PSTR("sync volume")) == 0){
+        volume_sync(-1);
+        volume_report();
+    }else if(strncmp_P(line, PSTR("sync volume "), 12) == 0){
+        if(console_number(line + 12, VOLUME_MAX, &number)){
+            volume_sync(number);
+            volume_report();
+        }
+    }else if(strcmp_P(line, PSTR("volume")) == 0)
+        volume_report();
+    else if(strcmp_P(line, PSTR("journal")) == 0){
+        journal_snapshot();
+        journal_dump();
+    }else if(strcmp_P(line, PSTR("tasks")) == 0)
+        sched_report();
+    else if(strcmp_P(line, PSTR("scenes")) == 0)
+        scene_report();
+    else if(strcmp_P(line, PSTR("scene stop")) == 0)
+        scene_stop();
+    else if(strncmp_P(line, PSTR("scene write "), 12) == 0)
+        console_scene_write(line + 12);
+    else if(strncmp_P(line, PSTR("scene "), 6) == 0){
+        if(console_number(line + 6, SCENE_MAX - 1, &number))
+            scene_run(number);
+    }
+    else if(strcmp_P(line, PSTR("baud")) == 0){
+        serial_baud_confirm();
+        serial_report();
+    }else if(strncmp_P(line, PSTR("baud "), 5) == 0)
+        console_baud(strtoul(line + 5, NULL, 10));
+    else if(strcmp_P(line, PSTR("ramp on")) == 0){
+        volume_ramp_enabled = true;
+        volume_report();
+    }else if(strcmp_P(line, PSTR("ramp off")) == 0){
+        volume_ramp_enabled = false;
+        volume_restore_pending = false;
+        volume_report();
+    }else
+        report("Unknown command \"%s\"\n", line);
+}
+
+static void check_console_line(int serial_in)
+{
+    if(serial_in == 0x0d || serial_in == 0x0a){
+        if(console_length){
+            report("\n");
+            console_line[console_length] = 0;
+            console_length = 0;
+            console_command(console_line);
+        }
+    }else if(serial_in == 0x7f || serial_in == 0x08){ // backspace and delete
+        if(console_length){
+            report("\x08 \x08"); // erase last char
+            console_length--;
+        }
+    }else if(serial_in >= 0x20 && console_length < (CONSOLE_LINE_LENGTH-1)){
+        console_line[console_length++] = serial_in;
+        serial_write_byte(serial_in);
+    }
+}
+
+static void check_serial_byte(int serial_in)
+{
+    if(hostlink_receive(serial_in))
+        return;
+
+    if(console_length){
+        check_console_line(serial_in);
+        return;
+    }
 
-    serial_in = serial_read_byte();
     switch(serial_in){
         case 'n':
         case 'N':
         case '1':
-            amp_on();
+            amp_on_requested();
             break;
         case 'f':
         case 'F':
         case '0':
-            amp_off();
+            amp_off_ramped();
             break;
         case 'd':
         case 'D':
             amp_off_delay();
             break;
+        case 'p':
+        case 'P':
+            predict_enabled = !predict_enabled;
+            report("Predictive power on: %s\n", predict_enabled?"enabled":"disabled");
+            break;
         case 'm':
         case 'M':
             vol_mute();
@@ -267,27 +766,275 @@ static void check_serial_input(void)
             vol_up();
             break;
         default:
+            check_console_line(serial_in);
             break;
     }
 }
 
+static void check_serial_input(void)
+{
+    int serial_in;
+
+    if(serial_periodic())
+        report("Serial: new baud rate not confirmed, back to %lu baud\n", serial_baud());
+
+    while((serial_in = serial_read_byte()) >= 0)
+        check_serial_byte(serial_in);
+}
+
+
+/* -- Host control protocol -- */
+
+_Static_assert(HP_STATUS_LENGTH <= HP_MAX_RESPONSE, "HP_GET_STATUS response too long");
+_Static_assert(sizeof(journal_counter) <= HP_MAX_RESPONSE, "HP_GET_STATS response too long");
+_Static_assert(4 + sizeof(serial_error) <= HP_MAX_RESPONSE, "HP_GET_SERIAL response too long");
+_Static_assert(SERIAL_BAUD_TIMEOUT_MS == HP_BAUD_CONFIRM_MS, "host and device disagree on the baud fallback time");
+
+void hostlink_request(uint8_t seq, uint8_t type, const uint8_t *payload, uint8_t length)
+{
+    uint8_t status[HP_STATUS_LENGTH];
+    uint8_t serial[4 + sizeof(serial_error)];
+    uint16_t errors[NUM_SERIAL_ERRORS];
+    uint32_t uptime, baud;
+
+    switch(type){
+        case HP_PING:
+            hostlink_respond(seq, type, HP_OK, 0, 0);
+            return;
+        case HP_GET_STATUS:
+            uptime = timer_millis();
+            status[HP_STATUS_AMP] = is_amp_powered_on();
+            status[HP_STATUS_DAC] = is_dac_powered_on();
+            status[HP_STATUS_VOLUME_KNOWN] = volume_known;
+            status[HP_STATUS_VOLUME] = volume_level;
+            status[HP_STATUS_PREDICT] = predict_enabled;
+            memcpy(&status[HP_STATUS_UPTIME], &uptime, sizeof(uptime));
+            hostlink_respond(seq, type, HP_OK, status, sizeof(status));
+            return;
+        case HP_GET_STATS:
+            hostlink_respond(seq, type, HP_OK, journal_counter, sizeof(journal_counter));
+            return;
+        case HP_SET_BAUD:
+            if(length != sizeof(baud))
+                break;
+            memcpy(&baud, payload, sizeof(baud));
+            if(!serial_baud_ok(baud))
+                break;
+            // answer at the old rate; serial_set_baud() waits for it to go
+            hostlink_respond(seq, type, HP_OK, 0, 0);
+            serial_set_baud(baud);
+            return;
+        case HP_GET_SERIAL:
+            baud = serial_baud();
+            memcpy(serial, &baud, sizeof(baud));
+            serial_get_errors(errors);
+            memcpy(&serial[4], errors, sizeof(errors));
+            hostlink_respond(seq, type, HP_OK, serial, sizeof(serial));
+            return;
+        case HP_SCENE:
+            if(length != 1)
+                break;
+            if(payload[0] == HP_SCENE_STOP)
+                scene_stop();
+            else if(!scene_run(payload[0])){
+                hostlink_respond(seq, type, HP_ERR_STATE, 0, 0);
+                return;
+            }
+            hostlink_respond(seq, type, HP_OK, 0, 0);
+            return;
+        case HP_SCENE_WRITE:
+            if(scene_write_busy()){
+                hostlink_respond(seq, type, HP_ERR_STATE, 0, 0);
+                return;
+            }
+            if(length < 1 || !scene_write(payload[0], payload + 1, length - 1))
+                break;
+            hostlink_respond(seq, type, HP_OK, 0, 0);
+            return;
+        case HP_AMP:
+            if(length != 1)
+                break;
+            // respond first, amp_on() and amp_off() take a while
+            switch(payload[0]){
+                case HP_AMP_OFF:
+                    hostlink_respond(seq, type, HP_OK, 0, 0);
+                    amp_off_ramped();
+                    return;
+                case HP_AMP_ON:
+                    hostlink_respond(seq, type, HP_OK, 0, 0);
+                    amp_on_requested();
+                    return;
+                case HP_AMP_OFF_DELAYED:
+                    hostlink_respond(seq, type, HP_OK, 0, 0);
+                    amp_off_delay();
+                    return;
+            }
+            break;
+        case HP_VOLUME:
+            if(length < 1)
+                break;
+            switch(payload[0]){
+                case HP_VOLUME_DOWN:
+                    hostlink_respond(seq, type, HP_OK, 0, 0);
+                    vol_down();
+                    return;
+                case HP_VOLUME_UP:
+                    hostlink_respond(seq, type, HP_OK, 0, 0);
+                    vol_up();
+                    return;
+                case HP_VOLUME_MUTE:
+                    hostlink_respond(seq, type, HP_OK, 0, 0);
+                    vol_mute();
+                    return;
+                case HP_VOLUME_SET:
+                    if(length != 2 || payload[1] > VOLUME_MAX)
+                        break;
+                    if(!is_dac_powered_on()){
+                        hostlink_respond(seq, type, HP_ERR_STATE, 0, 0);
+                        return;
+                    }
+                    hostlink_respond(seq, type, HP_OK, 0, 0);
+                    volume_set(payload[1]);
+                    return;
+            }
+            break;
+        default:
+            hostlink_respond(seq, type, HP_ERR_TYPE, 0, 0);
+            return;
+    }
+
+    hostlink_respond(seq, type, HP_ERR_ARG, 0, 0);
+}
+
+
+/* -- Warm restart -- */
+
+/* Keep a copy of our state where it will survive a reset, see warm.h */
+static void warm_save(void)
+{
+    warm_state.amp_power_on = last_amp_power_on;
+    warm_state.dac_power_on = last_dac_power_on;
+    warm_state.amp_off_timer = amp_off_timer;
+    warm_state.amp_off_after_ramp = amp_off_after_ramp;
+    warm_state.predict_enabled = predict_enabled;
+    warm_state.predict_pending = predict_pending;
+    warm_state.volume_known = volume_known;
+    warm_state.volume_level = volume_level;
+    warm_state.volume_target = volume_target;
+    warm_state.volume_after_sync = volume_after_sync;
+    warm_state.volume_syncing = volume_syncing;
+    warm_state.volume_ramp_enabled = volume_ramp_enabled;
+    warm_state.volume_restore_pending = volume_restore_pending;
+    warm_state.volume_restore_level = volume_restore_level;
+    warm_seal();
+}
+
+static void warm_restore(void)
+{
+    uint32_t now = timer_millis();
+
+    // timers restart from now, with whatever time they had left
+    last_amp_power_on = warm_state.amp_power_on;
+    last_dac_power_on = warm_state.dac_power_on;
+    amp_off_timer = warm_state.amp_off_timer;
+    amp_off_timer_ms = now;
+    amp_off_after_ramp = warm_state.amp_off_after_ramp;
+    predict_enabled = warm_state.predict_enabled;
+    predict_pending = warm_state.predict_pending;
+    predict_start_ms = now;
+    volume_known = warm_state.volume_known;
+    volume_level = warm_state.volume_level;
+    volume_target = warm_state.volume_target;
+    volume_after_sync = warm_state.volume_after_sync;
+    volume_syncing = warm_state.volume_syncing;
+    volume_ramp_enabled = warm_state.volume_ramp_enabled;
+    volume_restore_pending = warm_state.volume_restore_pending;
+    volume_restore_level = warm_state.volume_restore_level;
+
+    report("Warm restart: amp %s, DAC %s, volume %d%s\n",
+            last_amp_power_on ? "ON" : "OFF", last_dac_power_on ? "ON" : "OFF",
+            volume_level, volume_known ? "" : " (unknown)");
+}
+
+
+/* -- Task table -- */
+
+/* Listed in priority order, see sched.h. Relaying IR comes first since the
+ * user is waiting on it; the critical tasks must all keep running for the
+ * watchdog to be fed. */
+#define TASK(id, fn, period, deadline, crit) \
+    [id] = { .name = task_name_ ## id, .run = fn, .period_ms = period, .deadline_ms = deadline, .critical = crit }
+
+static const char task_name_TASK_INFRARED[]  PROGMEM = "infrared";
+static const char task_name_TASK_AMP_POWER[] PROGMEM = "amp power";
+static const char task_name_TASK_PREDICT[]   PROGMEM = "predict";
+static const char task_name_TASK_SERIAL[]    PROGMEM = "serial";
+static const char task_name_TASK_VOLUME[]    PROGMEM = "volume";
+static const char task_name_TASK_USER_LED[]  PROGMEM = "user LED";
+static const char task_name_TASK_SCENE[]     PROGMEM = "scene";
+static const char task_name_TASK_WARM[]      PROGMEM = "warm";
+static const char task_name_TASK_HOSTLINK[]  PROGMEM = "hostlink";
+static const char task_name_TASK_JOURNAL[]   PROGMEM = "journal";
+static const char task_name_TASK_DEBUG[]     PROGMEM = "debug";
+
+struct task sched_tasks[NUM_TASKS] = {
+    //   task number     function                period  deadline  critical
+    TASK(TASK_INFRARED,  check_infrared_input,   10,     100,      true),
+    TASK(TASK_AMP_POWER, check_amp_power,        10,     100,      true),
+    TASK(TASK_PREDICT,   check_predictive_power, 10,     100,      false),
+    TASK(TASK_SERIAL,    check_serial_input,     10,     100,      true),
+    TASK(TASK_VOLUME,    check_volume,           10,     100,      false),
+    TASK(TASK_USER_LED,  check_user_led,         10,     100,      false),
+    TASK(TASK_SCENE,     scene_periodic,         10,     100,      false),
+    TASK(TASK_WARM,      warm_save,              10,     100,      false),
+    TASK(TASK_HOSTLINK,  hostlink_periodic,      50,     100,      false),
+    TASK(TASK_JOURNAL,   journal_periodic,       1000,   1000,     false),
+    TASK(TASK_DEBUG,     debug_periodic,         1000,   1000,     false),
+};
+
 
 /* -- Initialisation and main loop -- */
 
+static void report_reset_cause(uint8_t flags)
+{
+    report("Reset cause:%s%s%s%s%s\n",
+            flags ? "" : " unknown",
+            (flags & _BV(PORF))  ? " power-on"  : "",
+            (flags & _BV(EXTRF)) ? " external"  : "",
+            (flags & _BV(BORF))  ? " brown-out" : "",
+            (flags & _BV(WDRF))  ? " watchdog"  : "");
+    if(flags & _BV(WDRF))
+        report("Watchdog fired in task: %S\n", sched_task_name(warm_state.watchdog_task));
+}
+
 int main(void)
 {
-    // enable the watchdog timer
-    wdt_enable(WDTO_4S);
+    bool warm;
+
+    // enable the watchdog timer (reset_flags was read before main() started)
+    watchdog_init();
+
+    // run the CPU at F_CPU
+    clock_init();
 
     // initialise serial
     serial_init();
     debug_init();
 
+    // start the millisecond timer
+    timer_init();
+
     // enable interrupts (they are all masked initially)
     sei();
 
     // announce ourselves
     report("\nPower Amplifier IR control module version %S.\n\n", software_version_string);
+    warm = warm_init();
+    report_reset_cause(reset_flags);
+
+    // find our place in the EEPROM journal and record the reset
+    journal_init();
+    journal_log(JOURNAL_RESET, reset_flags, (warm ? JOURNAL_RESET_WARM : 0) | warm_state.watchdog_task);
 
     // ensure startup is in the desired state
     relay_off();
@@ -320,20 +1067,18 @@ int main(void)
     // initialise RC5 library -- this sets up the PIN_IR_RX for us
     RC5_Init();
 
-    // set these up to force a status report on our first loop
-    last_amp_power_on = !is_amp_powered_on();
-    last_dac_power_on = !is_dac_powered_on();
-
-    while(1){
-        wdt_reset();
-        debug_periodic();
-
-        check_amp_power();
-        check_serial_input();
-        check_infrared_input();
-        check_user_led();
+    if(warm){
+        // carry on as we were, without re-running power transitions
+        warm_restore();
+    }else{
+        // set these up to force a status report on our first loop
+        last_amp_power_on = !is_amp_powered_on();
+        last_dac_power_on = !is_dac_powered_on();
     }
 
+    // run the tasks; the scheduler feeds the watchdog
+    sched_run();
+
     return 0;
 }
 
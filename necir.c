@@ -4,103 +4,177 @@
 #include <stdbool.h>
 #include <avr/io.h>
 #include "pins.h"
-
-/* ask delay.h to prefer shorter delays, since we have some CPU overhead also */
-#define __DELAY_ROUND_DOWN__ 1
-#include <util/delay.h>
+#include "timer.h"
 
 /*
    This is a very simple NEC IR protocol tranmission routine.
    CPU generates PWM with delay loops.
 */
 
-static inline void nec_led_on(void)
-{
-    /* IR transmitter LED on */
-    PORTD |= (_BV(PIN_IR_TX));
-}
-
 static inline void nec_led_off(void)
 {
     /* IR transmitter LED off */
     PORTD &= ~(_BV(PIN_IR_TX));
 }
 
-/* this time is half a cycle of the 38KHz carrier */
-#define BASIC_DELAY (1000000.0/38000.0/2.0) /* note that delay_us expects a floating point argument */
-
-static void nec_burst_1(void)
-{
-    /* send about 562.5us of 38kHz */
-    for(uint8_t n=0; n<21; n++){
-        nec_led_on();
-        _delay_us(BASIC_DELAY);
-        nec_led_off();
-        _delay_us(BASIC_DELAY);
-    }
-}
+/*
+   All the timing is worked out at compile time from F_CPU, and the transmit
+   loop below is written in assembler so that every cycle of it is counted.
 
-static void nec_burst_0(void)
+   Half a cycle of the 38kHz carrier, in CPU cycles, rounded. The delays make
+   up the rest of each half cycle: the LED is on from the sbi to the cbi (2
+   cycles), and off from the cbi through the loop back to the next sbi (8).
+*/
+#define HALF_CYCLE_CYCLES ((F_CPU + NEC_CARRIER_FREQUENCY) / (2UL * NEC_CARRIER_FREQUENCY))
+#define FIRST_HALF_OVERHEAD_CYCLES 2
+#define SECOND_HALF_OVERHEAD_CYCLES 8
+#define FIRST_HALF_DELAY_CYCLES (HALF_CYCLE_CYCLES - FIRST_HALF_OVERHEAD_CYCLES)
+#define SECOND_HALF_DELAY_CYCLES (HALF_CYCLE_CYCLES - SECOND_HALF_OVERHEAD_CYCLES)
+
+/* the carrier frequency we actually generate */
+#define ACTUAL_CARRIER_FREQUENCY (F_CPU / (2UL * HALF_CYCLE_CYCLES))
+
+/* Moving on to the next unit adds a fixed 10 cycles to its last carrier cycle
+   (fetching the next bit, counting units and reloading the cycle count). */
+#define UNIT_OVERHEAD_CYCLES 10
+
+/* The NEC protocol is built from units of 562.5us. Work out how many
+   carrier cycles make up one unit, rounded, allowing for the overhead. */
+#define NEC_UNIT_NS 562500ULL
+#define UNIT_CPU_CYCLES (NEC_UNIT_NS * F_CPU / 1000000000ULL)
+#define UNIT_CYCLES ((UNIT_CPU_CYCLES - UNIT_OVERHEAD_CYCLES + HALF_CYCLE_CYCLES) / (2 * HALF_CYCLE_CYCLES))
+#define ACTUAL_UNIT_NS ((UNIT_CYCLES * 2 * HALF_CYCLE_CYCLES + UNIT_OVERHEAD_CYCLES) * 1000000000ULL / F_CPU)
+
+#define HEADER_MARK_UNITS 16    /* 9ms */
+#define HEADER_SPACE_UNITS 8    /* 4.5ms */
+#define REPEAT_SPACE_UNITS 4    /* 2.25ms */
+
+/* A message always has 16 one bits (4 units) and 16 zero bits (2 units),
+   since each byte is followed by its inverse, then a final unit. */
+#define MESSAGE_UNITS (HEADER_MARK_UNITS + HEADER_SPACE_UNITS + (16 * 4) + (16 * 2) + 1)
+#define REPEAT_UNITS (HEADER_MARK_UNITS + REPEAT_SPACE_UNITS + 1)
+
+/* Elapsed time is exact to the cycle, apart from the few cycles of call and
+   setup around the transmit loop. */
+#define UNITS_TO_US(units) ((units) * ACTUAL_UNIT_NS / 1000)
+
+/* The millisecond timer interrupt would stretch a carrier cycle every 1ms
+   (by ~5% at 1MHz), so it is held off while we transmit; the asserts below
+   then only have to cover rounding. */
+
+#define ABS_DIFF(a, b) (((a) > (b)) ? ((a) - (b)) : ((b) - (a)))
+
+_Static_assert(HALF_CYCLE_CYCLES >= SECOND_HALF_OVERHEAD_CYCLES, "F_CPU is too slow to generate the NEC carrier");
+_Static_assert(FIRST_HALF_DELAY_CYCLES / 3 <= 255 && UNIT_CYCLES <= 255, "F_CPU is too fast for the NEC transmit loop");
+_Static_assert(ABS_DIFF(ACTUAL_CARRIER_FREQUENCY, NEC_CARRIER_FREQUENCY) * 100UL <= NEC_CARRIER_FREQUENCY * 2UL,
+        "NEC carrier frequency is more than 2% out");
+_Static_assert(ABS_DIFF(ACTUAL_UNIT_NS, NEC_UNIT_NS) * 100UL <= NEC_UNIT_NS * 3UL,
+        "NEC unit timing is more than 3% out");
+
+/* A frame is sent as a list of units, one bit each, MSB first: 1 for a unit
+   of carrier, 0 for a unit of silence. */
+struct nec_frame {
+    uint8_t units[(MESSAGE_UNITS + 7) / 8];
+    uint8_t length;
+};
+
+static void nec_add(struct nec_frame *frame, bool carrier, uint8_t length)
 {
-    /* send about 562.5us of silence */
-    for(uint8_t n=0; n<21; n++){
-        nec_led_off(); /* retain in case this affects timing */
-        _delay_us(BASIC_DELAY);
-        nec_led_off();
-        _delay_us(BASIC_DELAY);
+    while(length--){
+        if(carrier)
+            frame->units[frame->length / 8] |= 0x80 >> (frame->length % 8);
+        frame->length++;
     }
 }
 
-static void nec_encode_byte(bool *bitarray, uint8_t data)
+/* Delay an exact number of cycles: a 3 cycle loop, then up to 2 nops. */
+#define NEC_DELAY(name) \
+    ".if %[" name "_loops]\n\t" \
+    "ldi %[tmp], %[" name "_loops]\n" \
+    "1:\n\t" \
+    "dec %[tmp]\n\t" \
+    "brne 1b\n\t" \
+    ".endif\n\t" \
+    ".rept %[" name "_nops]\n\t" \
+    "nop\n\t" \
+    ".endr\n\t"
+
+static void nec_send(const struct nec_frame *frame)
 {
-    /* Bytes are sent MSB first */
-    for(uint8_t n=0; n<8; n++){
-        *bitarray = (data & 0x80) ? true : false;
-        bitarray++;
-        data = data << 1;
-    }
+    const uint8_t *units = frame->units;
+    uint8_t count = frame->length;
+    uint8_t bits, bit, cycle, tmp;
+
+    __asm__ __volatile__(
+        "rjmp 3f\n"
+        /* start a unit */
+        "2:\n\t"
+        "ldi %[cycle], %[unit_cycles]\n"
+        /* one carrier cycle, LED on (or left off) at the end of these 5 */
+        "4:\n\t"
+        "sbrs %[bits], 7\n\t"
+        "cbi %[port], %[pin]\n\t"
+        "sbrc %[bits], 7\n\t"
+        "sbi %[port], %[pin]\n\t"
+        NEC_DELAY("first")
+        "cbi %[port], %[pin]\n\t"
+        NEC_DELAY("second")
+        "dec %[cycle]\n\t"
+        "brne 4b\n\t"
+        /* next unit: 10 cycles whichever way, up to the end of the ldi */
+        "lsl %[bits]\n\t"
+        "dec %[count]\n\t"
+        "breq 6f\n\t"
+        "dec %[bit]\n\t"
+        "brne 5f\n"
+        "3:\n\t"
+        "ld %[bits], %a[units]+\n\t"
+        "ldi %[bit], 8\n\t"
+        "rjmp 2b\n"
+        "5:\n\t"
+        "rjmp .+0\n\t"
+        "rjmp 2b\n"
+        "6:\n\t"
+        : [units] "+e" (units), [count] "+r" (count), [bits] "=&r" (bits),
+          [bit] "=&d" (bit), [cycle] "=&d" (cycle), [tmp] "=&d" (tmp)
+        : [port] "I" (_SFR_IO_ADDR(PORTD)), [pin] "I" (PIN_IR_TX),
+          [unit_cycles] "M" (UNIT_CYCLES),
+          [first_loops] "n" (FIRST_HALF_DELAY_CYCLES / 3), [first_nops] "n" (FIRST_HALF_DELAY_CYCLES % 3),
+          [second_loops] "n" (SECOND_HALF_DELAY_CYCLES / 3), [second_nops] "n" (SECOND_HALF_DELAY_CYCLES % 3)
+        : "memory"
+    );
 }
 
 void send_nec_ir(uint8_t address, uint8_t command)
 {
-    bool message[32];
-
     /*
-       Encode the message in advance so the transmit loop is very simple.
-       The standard NEC message format is 32 bits long:
+       The standard NEC message format is 32 bits long: address byte,
+       inverted address byte, command byte and inverted command byte.
     */
-    nec_encode_byte(&message[0], address);   /* address byte */
-    nec_encode_byte(&message[8], ~address);  /* inverted address byte */
-    nec_encode_byte(&message[16], command);  /* command byte */
-    nec_encode_byte(&message[24], ~command); /* inverted command byte */
-
-    /* Send 9ms of 38kHz */
-    for(uint8_t n=0; n<16; n++){
-        nec_burst_1();
-    }
+    uint8_t message[4] = { address, ~address, command, ~command };
+    struct nec_frame frame = { {0}, 0 };
 
-    /* Then 4.5ms of silence */
-    for(uint8_t n=0; n<8; n++){
-        nec_burst_0();
-    }
+    /* 9ms of 38kHz, then 4.5ms of silence */
+    nec_add(&frame, true, HEADER_MARK_UNITS);
+    nec_add(&frame, false, HEADER_SPACE_UNITS);
 
-    /* Then the data stream */
+    /* Then the data stream, bytes are sent MSB first */
     for(uint8_t n=0; n<32; n++){
-        /* 0 and 1 bits start the same */
-        nec_burst_1();
-        nec_burst_0();
-        /* 1 bits are twice the duration of 0 bits */
-        if(message[n]){
-            nec_burst_0();
-            nec_burst_0();
-        }
+        /* 0 and 1 bits start the same, 1 bits are twice the duration */
+        nec_add(&frame, true, 1);
+        nec_add(&frame, false, (message[n / 8] & (0x80 >> (n % 8))) ? 3 : 1);
     }
 
     /* Then a final end bit */
-    nec_burst_1();
+    nec_add(&frame, true, 1);
+
+    timer_pause();
+    nec_send(&frame);
 
     /* Make sure we don't burn out the LED */
     nec_led_off();
+
+    timer_resume(UNITS_TO_US(MESSAGE_UNITS));
 }
 
 void send_nec_repeat(void) // *UNTESTED*
@@ -110,21 +184,20 @@ void send_nec_repeat(void) // *UNTESTED*
        This should be sent every 110ms after the initial code began, while the key is held down
     */
 
-    /* Send 9ms of 38kHz */
-    for(uint8_t n=0; n<16; n++){
-        nec_burst_1();
-    }
+    struct nec_frame frame = { {0}, 0 };
 
-    /* Then 2.25ms silence */
-    for(uint8_t n=0; n<4; n++){
-        nec_burst_0();
-    }
+    /* 9ms of 38kHz, 2.25ms silence, then a final end bit */
+    nec_add(&frame, true, HEADER_MARK_UNITS);
+    nec_add(&frame, false, REPEAT_SPACE_UNITS);
+    nec_add(&frame, true, 1);
 
-    /* Then a final end bit */
-    nec_burst_1();
+    timer_pause();
+    nec_send(&frame);
 
     /* Make sure we don't burn out the LED */
     nec_led_off();
+
+    timer_resume(UNITS_TO_US(REPEAT_UNITS));
 }
 
 /* vim:set shiftwidth=4 expandtab: */
@@ -10,17 +10,49 @@
 
 #include "rc5.h"
 #include "pins.h"
+#include "sched.h"
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
+
+/* An RC5 half bit is 32 cycles of the 36kHz carrier, 889us.
+ * Short pulses are one half bit and long pulses are two; we accept
+ * a short pulse within +/-50% and a long one within +/-25%.
+ * LONG_MIN should usually be SHORT_MAX + 1 */
+#define HALF_BIT_US 889
+#define SHORT_MIN_US (HALF_BIT_US / 2)          /* 444 microseconds */
+#define SHORT_MAX_US (HALF_BIT_US * 3 / 2)      /* 1333 microseconds */
+#define LONG_MIN_US (SHORT_MAX_US + 1)          /* 1334 microseconds */
+#define LONG_MAX_US (HALF_BIT_US * 2 * 5 / 4)   /* 2222 microseconds */
+
+/* Timer1 measures the pulses. Use the /8 prescaler if it still gives
+ * at least one tick per microsecond, so the counter takes longer to
+ * wrap (with a 16MHz clock: 500ns ticks), otherwise no prescaler. */
+#if (F_CPU / 8UL) >= 1000000UL
+#define TIMER_PRESCALER 8
+#define TIMER_CLOCK_SELECT _BV(CS11)
+#else
+#define TIMER_PRESCALER 1
+#define TIMER_CLOCK_SELECT _BV(CS10)
+#endif
 
 /* The formula to calculate ticks is as follows 
  * TICKS = PULSE_LENGTH / (1 / (CPU_FREQ / TIMER_PRESCALER))
- * Where CPU_FREQ is given in MHz and PULSE_LENGTH in us.
- * LONG_MIN should usually be SHORT_MAX + 1 */
-#define SHORT_MIN 888   /* 444 microseconds */
-#define SHORT_MAX 2666  /* 1333 microseconds */
-#define LONG_MIN 2668   /* 1334 microseconds */
-#define LONG_MAX 4444   /* 2222 microseconds */
+ * Where PULSE_LENGTH is given in us; rounded to the nearest tick. */
+#define US_TO_TICKS(us) (((F_CPU / 1000UL) * (us) + (TIMER_PRESCALER * 500UL)) / (TIMER_PRESCALER * 1000UL))
+
+#define SHORT_MIN US_TO_TICKS(SHORT_MIN_US)
+#define SHORT_MAX US_TO_TICKS(SHORT_MAX_US)
+#define LONG_MIN US_TO_TICKS(LONG_MIN_US)
+#define LONG_MAX US_TO_TICKS(LONG_MAX_US)
+
+_Static_assert((F_CPU % 1000UL) == 0, "F_CPU must be a whole number of kHz");
+_Static_assert(LONG_MAX <= 0xFFFF, "RC5 pulse timing overflows Timer1");
+/* rounding moves each threshold by up to half a tick; keep a whole
+ * tick under 1% of the shortest pulse we accept */
+_Static_assert((TIMER_PRESCALER * 1000000UL / (F_CPU / 1000UL)) * 100UL <= SHORT_MIN_US * 1000UL,
+        "Timer1 ticks are too coarse to time RC5 pulses");
+_Static_assert(SHORT_MAX < LONG_MIN, "RC5 short and long pulse windows overlap");
 
 typedef enum {
     STATE_START1, 
@@ -36,6 +68,7 @@ static const uint8_t trans[4] = {0x01, 0x91, 0x9b, 0xfb};
 static volatile uint16_t command;
 static uint8_t ccounter;
 static volatile uint8_t has_new;
+static volatile uint8_t activity_edges;
 static State state = STATE_BEGIN;
 
 void RC5_Init()
@@ -50,9 +83,9 @@ void RC5_Init()
     /* Reset Timer1 Counter */
     TCCR1A = 0;
 
-    /* Enable Timer1 in normal mode with /8 clock prescaling */
+    /* Enable Timer1 in normal mode with clock prescaling chosen above */
     /* One tick is 500ns with 16MHz clock */
-    TCCR1B = _BV(CS11);
+    TCCR1B = TIMER_CLOCK_SELECT;
     
     RC5_Reset();
 }
@@ -80,10 +113,28 @@ uint8_t RC5_NewCommandReceived(uint16_t *new_command)
     return has_new; 
 }
 
+uint8_t RC5_ActivityDetected()
+{
+    uint8_t edges;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        edges = activity_edges;
+        activity_edges = 0;
+    }
+
+    return edges;
+}
+
 ISR(INT0_vect)
 {
     uint16_t delay = TCNT1;
 
+    /* Any edge counts as activity, even if it never
+     * decodes into a valid command. */
+    if(activity_edges != 0xff)
+        activity_edges++;
+
     /* TSOP2236 pulls the data line up, giving active low,
      * so the output is inverted. If data pin is high then the edge
      * was falling and vice versa.
@@ -150,6 +201,7 @@ ISR(INT0_vect)
     {
         state = STATE_END;
         has_new = 1;
+        sched_wake_isr(TASK_INFRARED);
         
         /* Disable INT0 */
         EIMSK &= ~_BV(INT0);
@@ -48,6 +48,14 @@ void RC5_Reset();
  */
 uint8_t RC5_NewCommandReceived(uint16_t *new_command);
 
+/* Returns the number of edges seen on the input since
+ * the last call (saturating at 255), then clears it.
+ * Edges are only seen while the library is waiting
+ * for a command (ie not between a command being
+ * received and RC5_Reset being called).
+ */
+uint8_t RC5_ActivityDetected();
+
 
 #endif
 
@@ -0,0 +1,318 @@
+#include <stdbool.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include "debug.h"
+#include "timer.h"
+#include "scene.h"
+#include "journal.h"
+
+/*
+   A tiny interpreter for scenes: short bytecode sequences in EEPROM, see
+   scene.h for the instruction set. Each running scene executes at most one
+   instruction per pass of the scheduler, and waits are done by checking the
+   clock on later passes, so scenes never hold up IR relaying. Several scenes
+   can run at once, one per slot.
+*/
+
+enum {
+    SLOT_IDLE,
+    SLOT_RUNNING,
+    SLOT_WAIT,
+    SLOT_WAIT_UNTIL
+};
+
+struct scene_slot {
+    uint8_t state;
+    uint8_t scene;
+    uint16_t pc;            // offset of the next instruction
+    uint8_t condition;      // for SLOT_WAIT_UNTIL
+    uint16_t wait_ms;
+    uint32_t wait_start_ms;
+};
+
+static struct scene_slot slots[SCENE_SLOTS];
+static uint16_t last_trigger = 0xFFFF;  // RC5 code and toggle bit, to ignore repeats
+static uint32_t last_trigger_ms;
+
+static const uint8_t operand_count[NUM_SC_OPCODES] PROGMEM = {
+    [SC_END] = 0,
+    [SC_AMP_ON] = 0,
+    [SC_AMP_OFF] = 0,
+    [SC_AMP_OFF_DELAYED] = 0,
+    [SC_NEC] = 2,
+    [SC_VOLUME_SET] = 1,
+    [SC_WAIT] = 2,
+    [SC_WAIT_UNTIL] = 3,
+    [SC_SKIP_IF] = 2,
+    [SC_SKIP_UNLESS] = 2,
+};
+
+/* Default scenes, programmed with "make programeeprom". This is the only
+   EEMEM variable so it sits at the bottom of EEPROM, below the journal; the
+   Makefile checks it really is at address 0 after linking. */
+_Static_assert(SCENE_EEPROM_SIZE <= JOURNAL_EEPROM_START, "scenes overlap the journal");
+
+uint8_t scene_eeprom[SCENE_EEPROM_SIZE] EEMEM = {
+    // scene 0, "movie mode": no RC5 trigger, run it from the console
+    0xFF, 0xFF, SCENE_DIRECTORY_SIZE,
+    // scenes 1-7 are empty (zero offset)
+    [SCENE_DIRECTORY_SIZE] =
+    SC_AMP_ON,
+    SC_WAIT_UNTIL, SC_COND_AMP_ON, 0x10, 0x27,      // 10s for the amp to come on
+    SC_WAIT_UNTIL, SC_COND_DAC_ON, 0x10, 0x27,      // 10s for the DAC
+    SC_WAIT, 0xB8, 0x0B,                            // 3s for the DAC to accept IR
+    SC_NEC, 0x11, 0x20,                             // E70 input A
+    SC_VOLUME_SET, 30,
+    SC_END,
+};
+
+/* The journal writes EEPROM from its interrupt handler, so wait for any write
+   in progress with interrupts enabled, then read or write with them disabled
+   so the handler can't change EEAR under us.
+
+   Each byte takes ~3.4ms to write, so scene_write() only queues the data and
+   scene_periodic() starts the next byte whenever the EEPROM is free. */
+static uint8_t write_buffer[SCENE_WRITE_MAX];
+static uint8_t write_offset, write_length, write_done;
+
+static uint8_t scene_read_byte(uint8_t offset)
+{
+    uint8_t byte = 0;
+    bool done = false;
+
+    while(!done){
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+            if(!(EECR & _BV(EEPE))){
+                EEAR = (uintptr_t)&scene_eeprom[offset];
+                EECR |= _BV(EERE);
+                byte = EEDR;
+                done = true;
+            }
+        }
+    }
+
+    return byte;
+}
+
+/* Start writing the next queued byte if the EEPROM is free, skipping bytes
+   which already hold the right value. Never waits for a write to finish. */
+static void scene_write_some(void)
+{
+    uint8_t offset, byte;
+    bool busy = false;
+
+    while(write_done < write_length && !busy){
+        offset = write_offset + write_done;
+        byte = write_buffer[write_done];
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+            if(EECR & _BV(EEPE))
+                busy = true;
+            else{
+                EEAR = (uintptr_t)&scene_eeprom[offset];
+                EECR |= _BV(EERE);
+                if(EEDR != byte){
+                    EEDR = byte;
+                    EECR |= _BV(EEMPE);
+                    EECR |= _BV(EEPE);
+                    busy = true;
+                }
+                write_done++;
+            }
+        }
+    }
+}
+
+bool scene_write_busy(void)
+{
+    return write_done < write_length;
+}
+
+bool scene_write(uint8_t offset, const uint8_t *data, uint8_t length)
+{
+    if(offset + length > SCENE_EEPROM_SIZE || length > SCENE_WRITE_MAX || scene_write_busy())
+        return false;
+
+    memcpy(write_buffer, data, length);
+    write_offset = offset;
+    write_length = length;
+    write_done = 0;
+    scene_write_some();
+
+    return true;
+}
+
+static uint8_t scene_offset(uint8_t scene)
+{
+    uint8_t offset;
+
+    if(scene >= SCENE_MAX)
+        return 0;
+    offset = scene_read_byte(scene * 3 + 2);
+    if(offset < SCENE_DIRECTORY_SIZE || offset == 0xFF)
+        return 0;
+    return offset;
+}
+
+bool scene_run(uint8_t scene)
+{
+    struct scene_slot *slot, *free_slot = 0;
+    uint8_t offset = scene_offset(scene);
+
+    if(!offset){
+        report("Scene %d: empty\n", scene);
+        return false;
+    }
+
+    // restart the scene if it's already running, otherwise take a free slot
+    for(slot=slots; slot<&slots[SCENE_SLOTS]; slot++){
+        if(slot->state != SLOT_IDLE && slot->scene == scene){
+            free_slot = slot;
+            break;
+        }
+        if(slot->state == SLOT_IDLE && !free_slot)
+            free_slot = slot;
+    }
+
+    if(!free_slot){
+        report("Scene %d: no free slot\n", scene);
+        return false;
+    }
+
+    report("Scene %d: start\n", scene);
+    free_slot->state = SLOT_RUNNING;
+    free_slot->scene = scene;
+    free_slot->pc = offset;
+
+    return true;
+}
+
+void scene_stop(void)
+{
+    for(uint8_t i=0; i<SCENE_SLOTS; i++)
+        slots[i].state = SLOT_IDLE;
+}
+
+bool scene_trigger(uint8_t address, uint8_t command, uint8_t toggle)
+{
+    uint16_t code = (address << 8) | (command << 1) | toggle;
+    uint32_t now = timer_millis();
+    bool repeat;
+
+    /* A held key repeats the same code with the same toggle bit every 114ms.
+       Any other frame, or a longer gap, ends the repeat, since the toggle bit
+       alone would match every other press. */
+    repeat = (code == last_trigger && now - last_trigger_ms < SCENE_REPEAT_GAP_MS);
+    last_trigger = code;
+    last_trigger_ms = now;
+    if(repeat)
+        return false;
+
+    for(uint8_t scene=0; scene<SCENE_MAX; scene++){
+        if(scene_read_byte(scene * 3) == address &&
+                scene_read_byte(scene * 3 + 1) == command && scene_offset(scene))
+            return scene_run(scene);
+    }
+
+    return false;
+}
+
+static void scene_finish(struct scene_slot *slot, PGM_P why)
+{
+    report("Scene %d: %S\n", slot->scene, why);
+    slot->state = SLOT_IDLE;
+}
+
+static void scene_step(struct scene_slot *slot)
+{
+    uint8_t opcode, operands[3], count;
+    uint32_t now = timer_millis();
+
+    switch(slot->state){
+        case SLOT_WAIT:
+            if((now - slot->wait_start_ms) < slot->wait_ms)
+                return;
+            slot->state = SLOT_RUNNING;
+            break;
+        case SLOT_WAIT_UNTIL:
+            if(scene_condition(slot->condition))
+                slot->state = SLOT_RUNNING;
+            else if((now - slot->wait_start_ms) >= slot->wait_ms)
+                scene_finish(slot, PSTR("timed out"));
+            return; // carry on next pass
+    }
+
+    if(slot->pc >= SCENE_EEPROM_SIZE){
+        scene_finish(slot, PSTR("ran off the end"));
+        return;
+    }
+    opcode = scene_read_byte(slot->pc);
+    if(opcode >= NUM_SC_OPCODES){
+        scene_finish(slot, PSTR("bad opcode"));
+        return;
+    }
+    count = pgm_read_byte(&operand_count[opcode]);
+    if(slot->pc + 1 + count > SCENE_EEPROM_SIZE){
+        scene_finish(slot, PSTR("ran off the end"));
+        return;
+    }
+    for(uint8_t i=0; i<count; i++)
+        operands[i] = scene_read_byte(slot->pc + 1 + i);
+    slot->pc += 1 + count;
+
+    switch(opcode){
+        case SC_END:
+            scene_finish(slot, PSTR("done"));
+            break;
+        case SC_WAIT:
+            slot->wait_ms = operands[0] | (operands[1] << 8);
+            slot->wait_start_ms = now;
+            slot->state = SLOT_WAIT;
+            break;
+        case SC_WAIT_UNTIL:
+            slot->condition = operands[0];
+            slot->wait_ms = operands[1] | (operands[2] << 8);
+            slot->wait_start_ms = now;
+            slot->state = SLOT_WAIT_UNTIL;
+            break;
+        case SC_SKIP_IF:
+        case SC_SKIP_UNLESS:
+            if(scene_condition(operands[0]) == (opcode == SC_SKIP_IF))
+                slot->pc += operands[1];
+            break;
+        default:
+            scene_action(opcode, operands);
+            break;
+    }
+}
+
+void scene_periodic(void)
+{
+    scene_write_some();
+
+    for(uint8_t i=0; i<SCENE_SLOTS; i++){
+        if(slots[i].state != SLOT_IDLE)
+            scene_step(&slots[i]);
+    }
+}
+
+void scene_report(void)
+{
+    uint8_t offset;
+
+    for(uint8_t scene=0; scene<SCENE_MAX; scene++){
+        offset = scene_offset(scene);
+        if(offset)
+            report("Scene %d: offset %d, RC5 addr %d cmd %d\n", scene, offset,
+                    scene_read_byte(scene * 3), scene_read_byte(scene * 3 + 1));
+    }
+    for(uint8_t i=0; i<SCENE_SLOTS; i++){
+        if(slots[i].state != SLOT_IDLE)
+            report("Slot %d: scene %d at offset %d%S\n", i, slots[i].scene, slots[i].pc,
+                    (slots[i].state == SLOT_RUNNING) ? PSTR("") : PSTR(", waiting"));
+    }
+}
+
+/* vim:set shiftwidth=4 expandtab: */
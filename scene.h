@@ -0,0 +1,56 @@
+#ifndef __SCENE_DOT_H__
+#define __SCENE_DOT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Scenes live in the low 256 bytes of EEPROM (below the journal). The first
+   SCENE_MAX * 3 bytes are a directory; each entry is the RC5 address and
+   command which trigger the scene (0xFF 0xFF for none), then the offset of
+   its bytecode. Entries with an offset inside the directory, or 0xFF, are
+   empty. */
+#define SCENE_EEPROM_SIZE       0x100
+#define SCENE_MAX               8
+#define SCENE_DIRECTORY_SIZE    (SCENE_MAX * 3)
+#define SCENE_SLOTS             3       // scenes which can run at once
+#define SCENE_WRITE_MAX         32      // bytes scene_write() can queue at once
+#define SCENE_REPEAT_GAP_MS     150     // longer than the RC5 repeat interval (114ms)
+
+// opcodes, followed by their operands
+enum {
+    SC_END,                 // stop
+    SC_AMP_ON,
+    SC_AMP_OFF,
+    SC_AMP_OFF_DELAYED,
+    SC_NEC,                 // address, command: send an NEC IR frame
+    SC_VOLUME_SET,          // level: start stepping the volume to level
+    SC_WAIT,                // ms low, ms high
+    SC_WAIT_UNTIL,          // condition, timeout ms low, high: stop the scene on timeout
+    SC_SKIP_IF,             // condition, count: skip count bytes if condition is true
+    SC_SKIP_UNLESS,         // condition, count: skip count bytes if condition is false
+    NUM_SC_OPCODES
+};
+
+// conditions
+enum {
+    SC_COND_AMP_ON,
+    SC_COND_AMP_OFF,
+    SC_COND_DAC_ON,
+    SC_COND_DAC_OFF,
+    SC_COND_VOLUME_IDLE,    // no set volume in progress
+    NUM_SC_CONDS
+};
+
+void scene_periodic(void);
+bool scene_run(uint8_t scene);
+void scene_stop(void);
+bool scene_trigger(uint8_t address, uint8_t command, uint8_t toggle);
+bool scene_write(uint8_t offset, const uint8_t *data, uint8_t length); // queued, see scene_write_busy()
+bool scene_write_busy(void);
+void scene_report(void);
+
+// provided by main.c
+bool scene_condition(uint8_t condition);
+void scene_action(uint8_t opcode, const uint8_t *operands);
+
+#endif
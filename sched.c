@@ -0,0 +1,148 @@
+#include <stdbool.h>
+#include <avr/io.h>
+#include <avr/wdt.h>
+#include <avr/sleep.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "debug.h"
+#include "timer.h"
+#include "sched.h"
+
+/*
+   A small cooperative scheduler. Each pass we run the highest priority task
+   which is either due (its period has elapsed) or has been woken by an ISR.
+   Tasks must return promptly; one slow task delays all the others, which is
+   what the per-task accounting is there to show up.
+
+   The watchdog is only fed once every critical task has run since it was last
+   fed, so a task which is starved or stuck will reset us.
+*/
+
+volatile uint16_t sched_ready;
+volatile uint8_t sched_current = NUM_TASKS;
+
+static uint16_t progress;
+static uint32_t report_ms;
+
+void sched_wake(uint8_t task)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        sched_ready |= _BV(task);
+    }
+}
+
+static int8_t sched_pick(uint32_t now)
+{
+    uint16_t ready;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        ready = sched_ready;
+    }
+
+    for(uint8_t i=0; i<NUM_TASKS; i++){
+        if((ready & _BV(i)) || (int32_t)(now - sched_tasks[i].due_ms) >= 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static void sched_idle(void)
+{
+    // sleep until the next interrupt unless an ISR has already woken a task
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    cli();
+    if(!sched_ready){
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+    sei();
+}
+
+void sched_run(void)
+{
+    uint16_t critical = 0;
+    uint32_t now, start, elapsed, late;
+    struct task *task;
+    int8_t t;
+
+    now = timer_millis();
+    report_ms = now;
+    for(t=0; t<NUM_TASKS; t++){
+        sched_tasks[t].due_ms = now;
+        if(sched_tasks[t].critical)
+            critical |= _BV(t);
+    }
+
+    while(1){
+        now = timer_millis();
+        t = sched_pick(now);
+        if(t < 0){
+            sched_idle();
+            continue;
+        }
+
+        task = &sched_tasks[t];
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+            sched_ready &= ~_BV(t);
+        }
+
+        // tasks woken early by an ISR are never late
+        late = now - task->due_ms;
+        if((int32_t)late > 0 && late > task->deadline_ms)
+            task->misses++;
+        task->due_ms = now + task->period_ms;
+
+        start = timer_micros();
+        sched_current = t;
+        task->run();
+        sched_current = NUM_TASKS;
+        elapsed = timer_micros() - start;
+
+        task->runs++;
+        task->total_us += elapsed;
+        if(elapsed > task->max_us)
+            task->max_us = (elapsed > 0xFFFF) ? 0xFFFF : elapsed;
+
+        progress |= _BV(t);
+        if((progress & critical) == critical){
+            wdt_reset();
+            progress = 0;
+        }
+    }
+}
+
+PGM_P sched_task_name(uint8_t task)
+{
+    if(task >= NUM_TASKS)
+        return PSTR("scheduler");
+    return sched_tasks[task].name;
+}
+
+void sched_report(void)
+{
+    uint32_t now = timer_millis();
+    uint32_t period_ms = now - report_ms;
+    struct task *task;
+
+    if(period_ms == 0)
+        period_ms = 1;
+
+    report("Tasks over the last %lu ms:\n", period_ms);
+    report("task       runs  max us  total us  load  misses\n");
+    for(uint8_t t=0; t<NUM_TASKS; t++){
+        task = &sched_tasks[t];
+        report("%-9S %5u %7u %9lu %3lu.%lu%% %6u\n", task->name, task->runs, task->max_us,
+                task->total_us, task->total_us / (period_ms * 10),
+                (task->total_us / period_ms) % 10, task->misses);
+        task->runs = 0;
+        task->max_us = 0;
+        task->total_us = 0;
+        task->misses = 0;
+    }
+    report_ms = now;
+}
+
+/* vim:set shiftwidth=4 expandtab: */
@@ -0,0 +1,50 @@
+#ifndef __SCHED_DOT_H__
+#define __SCHED_DOT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <avr/pgmspace.h>
+
+// task numbers, in priority order (highest first)
+enum {
+    TASK_INFRARED,
+    TASK_AMP_POWER,
+    TASK_PREDICT,
+    TASK_SERIAL,
+    TASK_VOLUME,
+    TASK_USER_LED,
+    TASK_SCENE,
+    TASK_WARM,
+    TASK_HOSTLINK,
+    TASK_JOURNAL,
+    TASK_DEBUG,
+    NUM_TASKS
+};
+
+struct task {
+    PGM_P name;
+    void (*run)(void);
+    uint16_t period_ms;     // run at least this often
+    uint16_t deadline_ms;   // count a miss if we start this late
+    bool critical;          // must make progress for the watchdog to be fed
+    // accounting
+    uint32_t due_ms;
+    uint16_t runs;
+    uint16_t max_us;
+    uint32_t total_us;
+    uint16_t misses;
+};
+
+extern struct task sched_tasks[NUM_TASKS];
+extern volatile uint16_t sched_ready;
+extern volatile uint8_t sched_current;  // task running now, or NUM_TASKS
+
+// only for use in ISRs (or with interrupts disabled)
+#define sched_wake_isr(task) do { sched_ready |= _BV(task); } while(0)
+
+void sched_wake(uint8_t task);
+void sched_run(void); // never returns
+void sched_report(void);
+PGM_P sched_task_name(uint8_t task);
+
+#endif
@@ -1,24 +1,148 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "serial.h"
+#include "sched.h"
+#include "timer.h"
 
-#define TARGET_BAUD 115200
-#define TARGET_UBRR0 ((F_CPU / (8 * TARGET_BAUD)) - 1)
+/* The USART runs in double speed mode, where
+ * BAUD = F_CPU / (8 * (UBRR0 + 1))
+ * SERIAL_BAUD comes from the Makefile since the rates we can reach
+ * accurately depend on F_CPU. It is the rate we start at; serial_set_baud()
+ * can change it at run time. */
+#ifndef SERIAL_BAUD
+#define SERIAL_BAUD 115200
+#endif
+#define UBRR_FOR(baud) (((F_CPU + (4UL * (baud))) / (8UL * (baud))) - 1) // rounded
+#define BAUD_FOR(ubrr) (F_CPU / (8UL * ((ubrr) + 1)))
+#define TARGET_UBRR0 UBRR_FOR(SERIAL_BAUD)
+#define ACTUAL_BAUD BAUD_FOR(TARGET_UBRR0)
+#define BAUD_ERROR_PERMILLE (((ACTUAL_BAUD > SERIAL_BAUD) ? (ACTUAL_BAUD - SERIAL_BAUD) : \
+            (SERIAL_BAUD - ACTUAL_BAUD)) * 1000UL / SERIAL_BAUD)
+
+/* 115200 baud from 16MHz is 2.1% fast; receivers cope with a little more than that */
+#define MAX_BAUD_ERROR_PERMILLE 25
+
+_Static_assert(TARGET_UBRR0 <= 0xFFF, "SERIAL_BAUD is too slow for F_CPU");
+_Static_assert(BAUD_ERROR_PERMILLE <= MAX_BAUD_ERROR_PERMILLE, "SERIAL_BAUD can't be reached accurately at this F_CPU");
+
+/* received bytes are buffered by the RX interrupt so they aren't lost while
+   the main loop is busy (eg sending an IR code takes ~70ms). At 2Mbaud a
+   whole host frame arrives in 200us, so there is room for the largest. */
+#define RX_BUFFER_LENGTH 64 // must be a power of 2
+
+static volatile uint8_t rx_buffer[RX_BUFFER_LENGTH];
+static volatile uint8_t rx_head, rx_tail;
+
+volatile uint16_t serial_error[NUM_SERIAL_ERRORS];
+
+static uint16_t ubrr = TARGET_UBRR0;
+static uint16_t fallback_ubrr;      // rate to go back to if the new one isn't confirmed
+static bool baud_unconfirmed;
+static uint32_t baud_changed_ms;
+static bool tx_started;             // TXC0 is only meaningful once we've sent something
+
+static void serial_set_ubrr(uint16_t value)
+{
+    ubrr = value;
+    UBRR0H = (value >> 8);              // baud rate generator high byte
+    UBRR0L = (value & 0xFF);            // baud rate generator low byte, takes effect immediately
+}
 
 void serial_init(void)
 {
     // serial init: baud rate
-    UBRR0H = (TARGET_UBRR0 >> 8);       // baud rate generator high byte
-    UBRR0L = (TARGET_UBRR0 & 0xFF);     // baud rate generator low byte
+    serial_set_ubrr(TARGET_UBRR0);
     UCSR0A = _BV(U2X0);                 // double USART speed
-    UCSR0B = _BV(RXEN0) | _BV(TXEN0);   // enable receiver and transmitter
+    UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0); // enable receiver, transmitter and RX interrupt
     UCSR0C = _BV(UCSZ00) | _BV(UCSZ01); // 8N1 framing
 }
 
+/* Returns the UBRR0 value for baud, or -1 if it can't be generated to within
+ * MAX_BAUD_ERROR_PERMILLE. At 16MHz 500k, 1M and 2M are exact. */
+static int32_t serial_ubrr_for(uint32_t baud)
+{
+    uint32_t value, actual, error;
+
+    if(baud == 0 || baud > F_CPU / 8)
+        return -1;
+    value = UBRR_FOR(baud);
+    if(value > 0xFFF)
+        return -1;
+    actual = BAUD_FOR(value);
+    error = (actual > baud) ? (actual - baud) : (baud - actual);
+    if(error * 1000UL > baud * MAX_BAUD_ERROR_PERMILLE)
+        return -1;
+    return value;
+}
+
+bool serial_baud_ok(uint32_t baud)
+{
+    return serial_ubrr_for(baud) >= 0;
+}
+
+uint32_t serial_baud(void)
+{
+    return BAUD_FOR(ubrr);
+}
+
+/* wait until everything we've sent has left the shift register */
+static void serial_flush(void)
+{
+    if(tx_started)
+        while(!(UCSR0A & _BV(TXC0)));
+}
+
+bool serial_set_baud(uint32_t baud)
+{
+    int32_t value = serial_ubrr_for(baud);
+
+    if(value < 0)
+        return false;
+
+    serial_flush();
+    if(!baud_unconfirmed)
+        fallback_ubrr = ubrr;
+    serial_set_ubrr(value);
+    baud_unconfirmed = (value != fallback_ubrr);
+    baud_changed_ms = timer_millis();
+    return true;
+}
+
+void serial_baud_confirm(void)
+{
+    baud_unconfirmed = false;
+}
+
+bool serial_periodic(void)
+{
+    if(!baud_unconfirmed || (timer_millis() - baud_changed_ms) < SERIAL_BAUD_TIMEOUT_MS)
+        return false;
+
+    // nobody is talking to us at the new rate, go back to the one that worked
+    serial_flush();
+    serial_set_ubrr(fallback_ubrr);
+    baud_unconfirmed = false;
+    return true;
+}
+
+void serial_get_errors(uint16_t *errors)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        for(uint8_t i=0; i<NUM_SERIAL_ERRORS; i++)
+            errors[i] = serial_error[i];
+    }
+}
+
 int serial_read_byte(void)
 {
-    if(UCSR0A & _BV(RXC0))
-        return UDR0;
-    return -1;
+    uint8_t byte;
+
+    if(rx_tail == rx_head)
+        return -1;
+    byte = rx_buffer[rx_tail];
+    rx_tail = (rx_tail + 1) & (RX_BUFFER_LENGTH - 1);
+    return byte;
 }
 
 int serial_read_line(unsigned char *buffer, int buffer_length)
@@ -51,7 +175,9 @@ int serial_read_line(unsigned char *buffer, int buffer_length)
 void serial_write_byte(unsigned char byte)
 {
     while (!(UCSR0A & _BV(UDRE0))); // wait for transmission to complete
+    UCSR0A = _BV(U2X0) | _BV(TXC0);     // clear TXC0 (error flags must be written as zero)
     UDR0 = byte;
+    tx_started = true;
 }
 
 void serial_write(char *string)
@@ -61,4 +187,27 @@ void serial_write(char *string)
         serial_write_byte(*p++);
 }
 
+ISR(USART_RX_vect)
+{
+    uint8_t status = UCSR0A;    // the error flags belong to the byte in UDR0, so read them first
+    uint8_t byte = UDR0;
+    uint8_t next = (rx_head + 1) & (RX_BUFFER_LENGTH - 1);
+
+    if(status & _BV(DOR0))      // bytes were lost before this one, but it's good
+        serial_error[SERIAL_ERROR_OVERRUN]++;
+    if(status & _BV(FE0))
+        serial_error[SERIAL_ERROR_FRAME]++;
+    if(status & _BV(UPE0))
+        serial_error[SERIAL_ERROR_PARITY]++;
+
+    if(status & (_BV(FE0) | _BV(UPE0))){
+        // garbage, most likely sent at the wrong baud rate
+    }else if(next != rx_tail){
+        rx_buffer[rx_head] = byte;
+        rx_head = next;
+    }else
+        serial_error[SERIAL_ERROR_BUFFER]++;
+    sched_wake_isr(TASK_SERIAL);
+}
+
 /* vim:set shiftwidth=4 expandtab: */
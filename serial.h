@@ -1,10 +1,35 @@
 #ifndef __SERIAL_DOT_H__
 #define __SERIAL_DOT_H__
 
+#include <stdint.h>
+#include <stdbool.h>
+
+/* After serial_set_baud() the new rate must be confirmed within this long,
+   or we go back to the old one so a host that didn't follow can still talk
+   to us. */
+#define SERIAL_BAUD_TIMEOUT_MS 10000
+
+enum {
+    SERIAL_ERROR_FRAME,     // missing stop bit: wrong baud rate, or noise
+    SERIAL_ERROR_OVERRUN,   // a byte arrived before the RX interrupt could read the last
+    SERIAL_ERROR_PARITY,    // only possible if parity is turned on
+    SERIAL_ERROR_BUFFER,    // RX buffer full, byte dropped
+    NUM_SERIAL_ERRORS
+};
+
+extern volatile uint16_t serial_error[NUM_SERIAL_ERRORS];
+
 void serial_init(void);
 void serial_write_byte(unsigned char byte);
 void serial_write(char *string);
 int serial_read_line(unsigned char *buffer, int buffer_length); // read until newline (discards newline)
 int serial_read_byte(void);
 
+bool serial_baud_ok(uint32_t baud); // can we generate this rate accurately?
+bool serial_set_baud(uint32_t baud); // waits for pending output, then switches
+void serial_baud_confirm(void); // the host is talking to us at the new rate
+bool serial_periodic(void); // returns true if an unconfirmed rate was abandoned
+uint32_t serial_baud(void);
+void serial_get_errors(uint16_t *errors); // copies serial_error[]
+
 #endif
@@ -0,0 +1,126 @@
+#include <avr/io.h>
+#include <avr/power.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "timer.h"
+
+/* The crystal frequency comes from the Makefile. F_CPU may be lower, in which
+   case we divide the crystal down with the system clock prescaler. */
+#ifndef CRYSTAL_FREQ
+#define CRYSTAL_FREQ F_CPU
+#endif
+
+#if CRYSTAL_FREQ == F_CPU
+#define CLOCK_DIV clock_div_1
+#elif CRYSTAL_FREQ == (F_CPU * 2)
+#define CLOCK_DIV clock_div_2
+#elif CRYSTAL_FREQ == (F_CPU * 4)
+#define CLOCK_DIV clock_div_4
+#elif CRYSTAL_FREQ == (F_CPU * 8)
+#define CLOCK_DIV clock_div_8
+#elif CRYSTAL_FREQ == (F_CPU * 16)
+#define CLOCK_DIV clock_div_16
+#elif CRYSTAL_FREQ == (F_CPU * 32)
+#define CLOCK_DIV clock_div_32
+#elif CRYSTAL_FREQ == (F_CPU * 64)
+#define CLOCK_DIV clock_div_64
+#elif CRYSTAL_FREQ == (F_CPU * 128)
+#define CLOCK_DIV clock_div_128
+#elif CRYSTAL_FREQ == (F_CPU * 256)
+#define CLOCK_DIV clock_div_256
+#else
+#error "F_CPU must be CRYSTAL_FREQ divided by a power of two"
+#endif
+
+/* Timer0 runs in CTC mode and interrupts once per millisecond. Use the
+   largest prescaler which divides F_CPU down to an exact 1ms period. */
+#if (F_CPU % 64000UL) == 0 && (F_CPU / 64000UL) <= 256
+#define TIMER0_PRESCALE 64
+#define TIMER0_CLOCK_SELECT (_BV(CS01) | _BV(CS00))
+#elif (F_CPU % 8000UL) == 0 && (F_CPU / 8000UL) <= 256
+#define TIMER0_PRESCALE 8
+#define TIMER0_CLOCK_SELECT _BV(CS01)
+#elif (F_CPU % 1000UL) == 0 && (F_CPU / 1000UL) <= 256
+#define TIMER0_PRESCALE 1
+#define TIMER0_CLOCK_SELECT _BV(CS00)
+#else
+#error "Timer0 can't generate an exact 1ms tick at this F_CPU"
+#endif
+
+#define TIMER0_TOP ((F_CPU / TIMER0_PRESCALE / 1000) - 1)
+#define TIMER0_US_PER_TICK (1000 / (TIMER0_TOP + 1))
+
+_Static_assert((1000 % (TIMER0_TOP + 1)) == 0, "Timer0 ticks are not a whole number of microseconds");
+
+static volatile uint32_t millis;
+static uint16_t pause_us;           // position within the millisecond when paused
+
+void clock_init(void)
+{
+    clock_prescale_set(CLOCK_DIV);
+}
+
+void timer_init(void)
+{
+    TCCR0A = _BV(WGM01);                // CTC mode
+    TCCR0B = TIMER0_CLOCK_SELECT;       // clk/TIMER0_PRESCALE
+    OCR0A = TIMER0_TOP;                 // compare match once per millisecond
+    TIMSK0 = _BV(OCIE0A);               // enable compare match interrupt
+}
+
+uint32_t timer_millis(void)
+{
+    uint32_t now;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        now = millis;
+    }
+
+    return now;
+}
+
+uint32_t timer_micros(void)
+{
+    uint32_t now;
+    uint8_t ticks;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        now = millis;
+        ticks = TCNT0;
+        // the counter may have wrapped with the interrupt still pending
+        if((TIFR0 & _BV(OCF0A)) && ticks < (TIMER0_TOP / 2))
+            now++;
+    }
+
+    return (now * 1000) + (ticks * TIMER0_US_PER_TICK);
+}
+
+/* Timer0 keeps counting while the interrupt is off, so we know where in the
+   millisecond we stopped, and the caller knows how long it was busy for. */
+void timer_pause(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        if(TIFR0 & _BV(OCF0A)){     // a match the interrupt hasn't handled yet
+            TIFR0 = _BV(OCF0A);
+            millis++;
+        }
+        pause_us = TCNT0 * TIMER0_US_PER_TICK;
+        TIMSK0 &= ~_BV(OCIE0A);
+    }
+}
+
+void timer_resume(uint32_t elapsed_us)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        millis += (pause_us + elapsed_us) / 1000;
+        TIFR0 = _BV(OCF0A);         // counted above
+        TIMSK0 |= _BV(OCIE0A);
+    }
+}
+
+ISR(TIMER0_COMPA_vect)
+{
+    millis++;
+}
+
+/* vim:set shiftwidth=4 expandtab: */
@@ -0,0 +1,15 @@
+#ifndef __TIMER_DOT_H__
+#define __TIMER_DOT_H__
+
+#include <stdint.h>
+
+void clock_init(void); // divide the crystal down to F_CPU
+void timer_init(void);
+uint32_t timer_millis(void); // milliseconds since timer_init(), wraps after ~49 days
+uint32_t timer_micros(void); // microseconds since timer_init(), wraps after ~71 minutes
+
+// hold off the millisecond interrupt during cycle-counted code, then add the time back
+void timer_pause(void);
+void timer_resume(uint32_t elapsed_us);
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <avr/io.h>
+#include <avr/wdt.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+#include <util/atomic.h>
+#include "sched.h"
+#include "version.h"
+#include "warm.h"
+
+/*
+   The .noinit section is left alone by the C startup code, so whatever was
+   there before a reset is still there afterwards. A power-on reset leaves it
+   full of garbage, which the checksum catches.
+
+   The checksum starts from a CRC of the version string, which makeversion
+   stamps with the build time on every build, so a snapshot left by a
+   different build (perhaps with the fields in a different order) is never
+   restored into this one.
+*/
+
+#define WARM_MAGIC (0x5741 ^ sizeof(struct warm_state) ^ (WARM_LAYOUT_VERSION << 8))
+
+/* Optiboot reads and clears MCUSR before starting us. From version 4.6 it
+   passes the flags on in r2; its version is in the last word of flash. */
+#define OPTIBOOT_VERSION_ADDRESS (FLASHEND - 1)
+#define OPTIBOOT_FLAGS_VERSION   0x0406
+#define RESET_FLAGS_MASK         (_BV(WDRF) | _BV(BORF) | _BV(EXTRF) | _BV(PORF))
+
+struct warm_state warm_state __attribute__((section(".noinit")));
+uint8_t reset_flags __attribute__((section(".noinit")));
+uint8_t bootloader_flags __attribute__((section(".noinit")));
+
+static uint16_t warm_seed;
+
+/* Runs first thing in the startup code, before r2 gets used. */
+void bootloader_flags_init(void) __attribute__((naked, used, section(".init0")));
+void bootloader_flags_init(void)
+{
+    __asm__ __volatile__ ("sts %0, r2\n" : "=m" (bootloader_flags) :);
+}
+
+/* Runs from the startup code before main(). The watchdog stays enabled after
+   a watchdog reset (with the shortest timeout) unless WDRF is cleared, so do
+   that as early as possible. */
+void reset_flags_init(void) __attribute__((naked, used, section(".init3")));
+void reset_flags_init(void)
+{
+    reset_flags = MCUSR;
+    MCUSR = 0;
+    wdt_disable();
+}
+
+/* If MCUSR was cleared before we got to it, take the flags from r2, but only
+   from a bootloader we know puts them there. Otherwise they stay unknown. */
+static void reset_flags_merge(void)
+{
+    uint16_t version = pgm_read_word(OPTIBOOT_VERSION_ADDRESS);
+
+    if(reset_flags || version == 0xFFFF)
+        return; // MCUSR was intact, or there's no bootloader
+    version &= 0x7FFF; // custom Optiboot builds set the top bit
+    if(version >= OPTIBOOT_FLAGS_VERSION && !(bootloader_flags & ~RESET_FLAGS_MASK))
+        reset_flags = bootloader_flags;
+}
+
+static uint16_t warm_checksum(void)
+{
+    const uint8_t *p = (const uint8_t*)&warm_state;
+    uint16_t crc = warm_seed;
+
+    for(uint8_t i=0; i<offsetof(struct warm_state, checksum); i++)
+        crc = _crc_ccitt_update(crc, p[i]);
+
+    return crc;
+}
+
+void warm_seal(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        warm_state.magic = WARM_MAGIC;
+        warm_state.checksum = warm_checksum();
+    }
+}
+
+bool warm_init(void)
+{
+    PGM_P p = software_version_string;
+    bool valid;
+    char c;
+
+    reset_flags_merge();
+
+    warm_seed = 0xFFFF;
+    while((c = pgm_read_byte(p++)))
+        warm_seed = _crc_ccitt_update(warm_seed, c);
+
+    // with the reset flags unknown, only the checksum tells a cold start from a warm one
+    valid = !(reset_flags & _BV(PORF)) &&
+        warm_state.magic == WARM_MAGIC && warm_state.checksum == warm_checksum();
+
+    if(!(reset_flags & _BV(WDRF)) || !valid)
+        warm_state.watchdog_task = NUM_TASKS;
+
+    return valid;
+}
+
+void watchdog_init(void)
+{
+    /* Interrupt and reset mode: when the watchdog fires, the interrupt runs
+       first so we can record which task was stuck, and the next timeout
+       resets. The timed sequence has to be done with interrupts off. */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        wdt_reset();
+        WDTCSR = _BV(WDCE) | _BV(WDE);
+        WDTCSR = _BV(WDIE) | _BV(WDE) | _BV(WDP3); // 4 seconds
+    }
+}
+
+ISR(WDT_vect)
+{
+    warm_state.watchdog_task = sched_current;
+    warm_state.checksum = warm_checksum();
+
+    // no point waiting another four seconds for the reset
+    wdt_enable(WDTO_15MS);
+    while(1);
+}
+
+/* vim:set shiftwidth=4 expandtab: */
@@ -0,0 +1,39 @@
+#ifndef __WARM_DOT_H__
+#define __WARM_DOT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* State which survives a reset in RAM, so that after a watchdog or brown-out
+   reset we can pick up where we left off instead of starting from scratch.
+   main.c fills it in as it runs. Bump WARM_LAYOUT_VERSION when changing it. */
+#define WARM_LAYOUT_VERSION 1
+
+struct warm_state {
+    uint16_t magic;
+    uint8_t watchdog_task;          // task running when the watchdog fired, or NUM_TASKS
+    bool amp_power_on;
+    bool dac_power_on;
+    uint16_t amp_off_timer;
+    bool amp_off_after_ramp;
+    bool predict_enabled;
+    bool predict_pending;
+    bool volume_known;
+    uint8_t volume_level;
+    uint8_t volume_target;
+    uint8_t volume_after_sync;
+    bool volume_syncing;
+    bool volume_ramp_enabled;
+    bool volume_restore_pending;
+    uint8_t volume_restore_level;
+    uint16_t checksum;
+};
+
+extern struct warm_state warm_state;
+extern uint8_t reset_flags;         // MCUSR as found at reset, or 0 if unknown
+
+bool warm_init(void);               // true if warm_state survived the reset
+void warm_seal(void);               // call after updating warm_state
+void watchdog_init(void);
+
+#endif